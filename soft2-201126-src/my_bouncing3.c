@@ -4,68 +4,474 @@
   反発係数を0.01などの小さな値にしたときに自然な挙動をするように、速さだけでなく跳ね上がる距離にも反発係数をかけた
   dtを小さくして、その分スリープ時間を短くした(シミュレーションの1秒が現実時間の200msになるように)
   Gが大きい方が面白い挙動をするのでGを大きくした
+  近接遭遇した二体は相対運動だけを時間変換したleapfrog(logH)で細かく積分するようにした
+  (接近中のペア以外は通常のdtのまま進むので、全体のdtを小さくしなくてもよい)
+  同じマスに複数の物体があるときは、物体数に応じて濃淡のある文字で表示するようにした
+  (-w で質量による濃淡、-c でANSI 256色のグレースケール表示。マスへの振り分けはスレッドごとに並列に行う)
+  ファイル名の代わりに uniform, plummer, disk, sun を指定すると、初期値をその場で生成する
+  乱数はカウンタベース(Philox)で、種(-s)と物体のインデックスだけから決まるので並列に生成しても再現できる
+  (ファイルの物体数が足りないときの残りも同じ乱数で生成する)
+  融合の判定は、距離が閾値+余裕(skin)以内のペアのリストだけを調べる。
+  リストはどれかの物体が作り直したときから余裕の半分以上動いたときだけ作り直す。
+  -p で複数のプロセスに分けて計算する。画面をx方向に短冊状に分け、各プロセスは自分の領域の物体の速度と位置を更新する。
+  物体の配列はPOSIX共有メモリに置いて全プロセスから読めるようにし、ステップの区切りはプロセス間で共有したバリアで揃える。
+  融合と表示は最初のプロセスが行い、そのときに領域をまたいだ物体を移動先の領域に並べ替える。
+  (近接遭遇の正則化は同じ領域にいるペアだけが対象になる)
+  -z で指定したステップごとに、物体を画面上の位置のMortonコード(Z曲線)の順に並べ替える。
+  空間的に近い物体がメモリ上でも近くなるので、融合の候補探しや表示のキャッシュミスが減る。
+  並べ替えは8ビットずつの基数ソートで、各桁の数え上げと書き込みをスレッドで分けて行う。
+  物体には読み込んだ順の番号を持たせ、番号から配列の位置を引く表を使って表示するので、並べ替えても表示は変わらない。
+  -H でperf_event_openを使い、力・移動(反射を含む)・融合・並べ替え・表示の段階ごとにサイクル数、命令数、
+  L1データキャッシュとLLCのミス、分岐予測ミスを数え、終了時にIPCと物体1個あたりのミス数を表示する。
+  (数えるのはメインのスレッドだけなので、正確に比べるときは OMP_NUM_THREADS=1 で実行する)
+  壁での反射は分岐を使わず、画面内外が入れ替わったかの判定(読むだけ)と、入れ替わった物体だけの折り返しに分けた。
+  判定のループは -O3 -march=native でベクトル化される。
+  1つのプロセスで計算するときは、移動・反射・融合の候補のリストを作り直すかの判定・表示するマスの計算を
+  キャッシュに収まるまとまりごとにまとめて行い、物体の配列を1ステップに1回だけ読むようにした。
+  リストを作り直すときに各物体が候補の相手と融合するまでにどれだけ動く必要があるかを覚えておき、
+  それより動いていない物体は融合の判定で相手を調べない。
 
   実行例:
     t=20あたりから二体がくるくるする
     ./a.out 10 data3_kurukuru.dat
     三体の初期値が同じだった場合に動くかの確認
     ./a.out 3 data3_same.dat
+    質量で濃淡をつけてカラー表示
+    ./a.out -w -c 10 data3_kurukuru.dat
+    プラマー球、回転する円盤、太陽と軽い物体
+    ./a.out -w 2000 plummer
+    ./a.out -s 42 -w 2000 disk
+    ./a.out 200 sun
+    4プロセスで計算
+    ./a.out -p 4 -w 2000 uniform
+    段階ごとのハードウェアカウンタを表示
+    OMP_NUM_THREADS=1 ./a.out -H 2000 uniform
+    ステップごとの段階とスレッドの区間を記録して、Perfettoやchrome://tracingで見る
+    ./a.out -t trace.json -w 20000 plummer
+    始める前に力の計算の方法・タイルの大きさ・スレッド数を測って選ぶ(2回目からは覚えておいた結果を使う)
+    ./a.out -a -w 5000 uniform
+    太陽の周りの軽い物体を、太陽だけから力を受けるテスト粒子として進める
+    ./a.out -T 1 -w 20000 sun
+    融合する時刻を予測して、ステップの途中で閾値を横切った時刻に融合する
+    ./a.out -e -w 20000 plummer
+    物体の配列をTHPに置き、移動の計算(fused_step)と同じ分け方で各スレッドのNUMAノードに置く
+    ./a.out -A thp -N partition 10000000 uniform
+    100ステップごとに並べ替える
+    ./a.out -z 100 -w 20000 plummer
+    初期値を少しずつずらした4096通りの系をまとめて進める
+    ./a.out -E 4096 3 data3.dat
+
+  -e では、融合の候補のペアごとに、物体が今の速度で直進したときに閾値+余裕(EVENT_MARGIN)まで近づく時刻を予測して
+  優先度付きの待ち行列に入れておき、時刻が来たペアだけを調べる。予測に使った直線から実際の位置が余裕の半分より
+  離れた物体(速度が大きく変わった、反射した、近接遭遇中)は、そのステップで全ての相手を調べて予測し直す
+  (古い予測は物体ごとに予測し直すたびに増やす版の番号で見分けて、取り出したときに捨てる)。
+  調べるペアは、ステップの中での直線の動きから閾値を横切る時刻を求め、その時刻の位置で融合して残りの時間を進めるので、
+  ステップの終わりまで融合が遅れたり、速くてすれ違った物体を見逃したりしない。
+  ただし見逃さないのは、候補のリストに入っているペアだけである。リストは1ステップで余裕の半分(skin/2)より動いた物体が
+  出たときに終わりの位置で作り直すので、1ステップでそれより大きく動く物体があると、ステップの途中だけ閾値まで近づいた
+  ペアがリストに入らず見逃すことがある(そのときは時間刻み幅を小さくするか、skinを大きくする)。
+  融合しても候補のリストと予測は番号を詰めて使い続け、融合した物体だけを予測し直す。
+
+  -t で指定したファイルに、ステップ、力・移動・融合・並べ替え・表示の段階、端末への書き出し、スリープの区間と、
+  各スレッドがfused_step、表示のマスへの振り分け、融合の候補のリストの作り直しで自分の分にかかった区間を、
+  Chromeのtrace event形式(JSON)で書き出す。区間は始める前に確保したスレッドごとのバッファに記録するだけなので、
+  記録中はファイルに書かず、1区間あたり時刻を2回読む程度の負担で済む(TRACE_CAPACITYを超えた分は捨てる)。
+
+  -T で指定した質量以下の物体をテスト粒子にする。テスト粒子は他の物体から力を受けるが、他の物体を引かないので、
+  力の計算は(重い物体の数)x(全体の数)で済む。重い物体だけを位置と質量の配列に集めておき、テスト粒子は
+  まとまりごとに重い物体を1つずつ全員に足すループで計算するので、重い物体が数個でもベクトル化される。
+  (近接遭遇の正則化は重い物体同士だけが対象になる。融合は今まで通りで、質量はテスト粒子の分も足す)
+
+  -a で始める前に、読み込んで融合を終えた物体で力の計算を何通りか測り、最も速いものを選ぶ。
+  物体の配列をそのまま読む直接計算と、相手の位置と質量を詰めた配列をタイルに分けて使い回す計算を、
+  タイルの大きさとスレッド数(1, 2, 4, ... と上限)を変えて、先頭の一部の物体の分だけ数回ずつ測る。
+  どちらも各物体では相手を同じ順番で足すので結果は変わらないが、念のため直接計算との差がTUNE_TOLERANCEを
+  超えるものは選ばない。選んだ結果はホスト名・物体数の範囲(2のべき乗ごと)・スレッド数の上限ごとに
+  ~/.my_bouncing3_tune に書いておき、次からは測らずに使う。(力の計算の方法はこの2通りで、木を使う方法はない)
+
+  -A で物体の配列のページを選ぶ(thp: transparent huge page、huge: 予約したhuge page。足りなければTHPにする)。
+  -N でページを置くNUMAノードを選ぶ(interleave: 全ノードに順番に、partition: 移動(fused_step)のループ
+  (schedule(static))と同じ分け方で各スレッドが自分の分を最初に書いて、そのスレッドのノードに置く)。どちらかを指定すると、始める前に
+  配列ごとの実際のページの大きさとノードごとのページの割合を表示する。
+  -a で並列にした力の計算は、選んだスレッド数で分け(タイルに分けるときはiの範囲を自分で等分する)、移動とは分け方が
+  同じとは限らないので、力の計算では他のノードのページを読む物体が出る。
+
+  -E で指定した数の系(物体数は16以下)を並べ、全ての系を同時に進めて最後にまとめて結果を表示する。
+  物体ごとに全ての系の値を隣り合わせに置き、系の並びをSIMDのレーンに詰めて力・移動・反射・融合を計算する。
+  融合で消えた物体は質量0、物体が1つになった系は止めたままにするので、系ごとの分岐はレーンごとの選択になる。
+  (近接遭遇の正則化は系ごとに相手が変わるので行わない)
+
+  コンパイル:
+    gcc -Wall -O2 -fopenmp -pthread my_bouncing3.c -lm
+  (glibcが古い場合は shm_open のために -lrt も付ける)
+  -E の系ごとのループをベクトル化するには、選択と平方根を分岐にしないように次のオプションも付ける
+    gcc -Wall -O3 -march=native -fno-math-errno -fno-trapping-math -fopenmp -pthread my_bouncing3.c -lm
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "my_bouncing3.h"
 
+// 密度の低い順に並べた表示用の文字
+static const char shade_chars[] = ".:-=+*#%@";
+
 int main(int argc, char **argv)
 {
+  int shade_mass = 0, color = 0;
+  unsigned long seed = 0;
+  int nproc = 1;
+  int perf = 0;
+  int sort_every = 0; // 何ステップごとにMortonコードの順に並べ替えるか(0なら並べ替えない)
+  size_t ensemble = 0; // 並べて同時に進める系の数(0なら今まで通り1つの系を表示しながら進める)
+  MemoryPolicy policy = {PAGES_DEFAULT, PLACE_FIRST_TOUCH};
+  int events = 0; // 1なら融合を予測した時刻の待ち行列で判定する
+  const char *trace_file = NULL; // 段階ごと・スレッドごとの区間を書き出すファイル(NULLなら記録しない)
+  int tune = 0; // 1なら始める前に力の計算の方法とスレッド数を測って選ぶ
+  double test_mass = -1; // この質量以下の物体をテスト粒子にする(負ならテスト粒子を使わない)
+  int report_memory = 0; // -Aか-Nを指定したら、確保した配列のページの大きさと置き場所を表示する
+
+  int opt;
+  while ((opt = getopt(argc, argv, "wcs:p:Hz:E:A:N:et:T:a")) != -1) {
+    switch (opt) {
+      case 'w':
+        shade_mass = 1;
+        break;
+      case 'c':
+        color = 1;
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        nproc = atoi(optarg);
+        if (nproc < 1 || nproc > MAX_DOMAINS) argc = 0;
+        break;
+      case 'H':
+        perf = 1;
+        break;
+      case 'z':
+        sort_every = atoi(optarg);
+        break;
+      case 'E':
+        // 負の数を符号なしで読むと大きな値になってしまうので、符号付きで読んでから確かめる
+        if (atol(optarg) < 1) argc = 0;
+        else ensemble = atol(optarg);
+        break;
+      case 'e':
+        events = 1;
+        break;
+      case 't':
+        trace_file = optarg;
+        break;
+      case 'a':
+        tune = 1;
+        break;
+      case 'T':
+        test_mass = strtod(optarg, NULL);
+        if (test_mass < 0) argc = 0;
+        break;
+      case 'A':
+        report_memory = 1;
+        if (strcmp(optarg, "default") == 0) policy.pages = PAGES_DEFAULT;
+        else if (strcmp(optarg, "thp") == 0) policy.pages = PAGES_THP;
+        else if (strcmp(optarg, "huge") == 0) policy.pages = PAGES_HUGETLB;
+        else argc = 0;
+        break;
+      case 'N':
+        report_memory = 1;
+        if (strcmp(optarg, "first") == 0) policy.placement = PLACE_FIRST_TOUCH;
+        else if (strcmp(optarg, "interleave") == 0) policy.placement = PLACE_INTERLEAVE;
+        else if (strcmp(optarg, "partition") == 0) policy.placement = PLACE_PARTITION;
+        else argc = 0;
+        break;
+      default:
+        argc = 0; // 使い方を表示させる
+    }
+  }
+
   const Condition cond = {
 		    .width  = 75,
 		    .height = 40,
 		    .G = 10.0,
 		    .dt = 0.1,
-		    .cor = 0.8
+		    .cor = 0.8,
+		    .encounter = 4,
+		    .threshold = 2,
+		    .skin = 2,
+		    .shade_mass = shade_mass,
+		    .color = color,
+		    .seed = seed
   };
 
-  if (argc != 3) {
-    fprintf(stderr, "usage: <objnum> <filename>\n");
+  if (argc - optind != 2) {
+    fprintf(stderr, "usage: [-w] [-c] [-s <seed>] [-p <nproc>] [-H] [-z <steps>] [-E <systems>] [-e] [-t <trace.json>] [-T <mass>] [-a] [-A default|thp|huge] [-N first|interleave|partition] <objnum> <filename | uniform | plummer | disk | sun>\n");
     return 1;
   }
   
-  size_t objnum = atoi(argv[1]);
-  Object objects[objnum];
+  size_t objnum = atol(argv[optind]);
+
+  // 小さな系をたくさん並べて進める場合は表示しない
+  if (ensemble > 0) {
+    if (objnum < 1 || objnum > ENSEMBLE_MAX_BODIES || nproc > 1) {
+      fprintf(stderr, "-E needs 1 to %d objects and a single process\n", ENSEMBLE_MAX_BODIES);
+      return 1;
+    }
+    Object system[ENSEMBLE_MAX_BODIES];
+    load_objects(objnum, system, argv[optind+1], cond);
+    run_ensemble(system, objnum, ensemble, 400, cond);
+    return EXIT_SUCCESS;
+  }
+  if (report_memory && nproc > 1) {
+    fprintf(stderr, "-A and -N need a single process\n");
+    return 1;
+  }
+  if (events && nproc > 1) {
+    fprintf(stderr, "-e needs a single process\n");
+    return 1;
+  }
+  if (test_mass >= 0 && nproc > 1) {
+    fprintf(stderr, "-T needs a single process\n");
+    return 1;
+  }
+  if (tune && (nproc > 1 || test_mass >= 0)) {
+    fprintf(stderr, "-a needs a single process and can't be used with -T\n");
+    return 1;
+  }
+
+  Object *objects;
+  DomainShared *domains = NULL;
+  BodyMemory object_memory = {0}, cell_memory = {0};
 
-  load_objects(objnum, objects, argv[2], cond);
+  if (nproc > 1) {
+    domains = create_domains(objnum, nproc);
+    objects = domains->objs;
+  } else {
+    objects = alloc_bodies(&object_memory, objnum, sizeof(Object), policy);
+    if (objects == NULL) {
+      fprintf(stderr, "Couldn't allocate %zu objects\n", objnum);
+      return 1;
+    }
+  }
+
+  load_objects(objnum, objects, argv[optind+1], cond);
+
+  // 物体を読み込めてから子プロセスを作る(読めずに終了したときに、子プロセスがバリアで待ったまま残らないように)
+  // 読み込みでOpenMPのスレッドができていても、子プロセスは並列の区間を使わないので問題ない
+  if (domains != NULL) {
+    int rank = fork_domains(domains);
+    if (rank > 0) {
+      while (domain_step(domains, rank, cond));
+      _exit(EXIT_SUCCESS);
+    }
+  }
+
+  // 並べ替えても表示する物体が変わらないように、番号から配列の位置を引けるようにしておく
+  const size_t numids = objnum;
+  int *index_of = malloc(sizeof(int) * numids);
+  if (index_of == NULL) {
+    fprintf(stderr, "Couldn't allocate id map\n");
+    return 1;
+  }
 
   // シミュレーション. ループは整数で回しつつ、実数時間も更新する
   const double stop_time = 400;
   double t = 0;
   printf("\n");
-  int line = 0;
+  int line = 0, last_line = 0;
+
+  // 融合の候補になるペアのリスト(物体があまり動いていなければ使い回す)
+  NeighborList neighbors = {.moved2 = -1};
+  // -eのときは、候補のペアが閾値まで近づく時刻を予測しておき、時刻が来たペアだけを調べる
+  EventQueue queue = {0};
+  // -Tのときは、テスト粒子より重い物体だけを集めて力を計算する
+  MassiveBodies massive = {.cutoff = test_mass};
+
+  // fused_stepで求めた各物体の表示するマス(融合や並べ替えで並びが変わったら使わない)
+  int *cells = alloc_bodies(&cell_memory, objnum + 1, sizeof(int), policy);
+  if (cells == NULL) {
+    fprintf(stderr, "Couldn't allocate screen cells\n");
+    return 1;
+  }
+  if (report_memory) {
+    report_bodies(&object_memory, "objects");
+    report_bodies(&cell_memory, "cells");
+  }
+
+  // -Hならハードウェアのカウンタで段階ごとの命令数やキャッシュミスを数える
+  PerfCounters counters = {0};
+  if (perf) perf_open(&counters);
+
+  // -tなら段階ごとの区間とスレッドごとの区間をバッファに記録し、終了時にChromeのtrace event形式で書き出す
+  // (複数プロセスのときは最初のプロセスの分だけ)
+  Tracer tracer;
+  if (trace_file != NULL) trace_open(&tracer, trace_file);
 
   // 初期位置で融合可能な場合は融合する(そうしないと画面外に吹っ飛んでいく)
-  fusion_objects(objects, &objnum, cond);
+  fusion_objects(objects, &objnum, &neighbors, cond);
+  if (domains != NULL) {
+    domains->numobj = objnum;
+    if (migrate_domains(domains, cond)) neighbors.valid = 0;
+  }
+
+  // -aなら初期位置での融合を終えた物体で力の計算の方法を選ぶ(同じホストと物体数の範囲で選んだことがあればそれを使う)
+  ForcePlan plan = {.method = FORCE_DIRECT, .tile = 0, .threads = 1};
+  if (tune) {
+    if (load_force_plan(&plan, objnum)) {
+      printf("force: %s", plan.method == FORCE_TILED ? "tiled" : "direct");
+    } else {
+      struct timespec t0, t1;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      plan = tune_force(objects, objnum, cond);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      save_force_plan(&plan, objnum);
+      printf("force: %s", plan.method == FORCE_TILED ? "tiled" : "direct");
+      printf(" (tuned in %.2lf s)", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9);
+    }
+    if (plan.method == FORCE_TILED) printf(", tile %d", plan.tile);
+    printf(", %d threads, %.3lg s/step\r\n", plan.threads, plan.seconds);
+  }
+
   for (int i = 0 ; t <= stop_time ; i++){
     t = i * cond.dt;
-    my_update_velocities(objects, objnum, cond);
-    my_update_positions(objects, objnum, cond);
-    my_bounce(objects, objnum, cond);
-    fusion_objects(objects, &objnum, cond);
+    trace_step(i);
+    const uint64_t step_start = trace_begin();
+    if (domains != NULL) {
+      // 複数プロセスのときは自分の領域の分だけが数えられる
+      perf_begin(&counters);
+      domain_step(domains, 0, cond);
+      perf_end(&counters, PHASE_FORCE, objnum);
+    } else {
+      perf_begin(&counters);
+      size_t pairs;
+      if (test_mass >= 0) {
+        gather_massive(objects, objnum, &massive);
+        pairs = find_massive_encounters(objects, &massive, cond);
+        update_velocities_test(objects, objnum, &massive, cond);
+      } else {
+        pairs = find_encounters(objects, objnum, cond);
+        if (tune) {
+          update_velocities_plan(objects, objnum, 0, objnum, &plan, cond);
+        } else {
+          my_update_velocities(objects, objnum, cond);
+        }
+      }
+      perf_end(&counters, PHASE_FORCE, objnum);
+
+      // 移動・反射・融合の候補のリストの確認・表示するマスの計算を、物体の配列を1回読むだけで行う
+      // (反射も含めてdrift+bounceとして数える)
+      perf_begin(&counters);
+      neighbors.moved2 = fused_step(objects, objnum, pairs, &neighbors, cells, cond);
+      perf_end(&counters, PHASE_DRIFT, objnum);
+    }
+    perf_begin(&counters);
+    const size_t before_fusion = objnum;
+    if (events) {
+      fusion_events(objects, &objnum, &neighbors, &queue, cond);
+    } else {
+      fusion_objects(objects, &objnum, &neighbors, cond);
+    }
+    int cells_valid = domains == NULL && objnum == before_fusion;
+
+    // 融合で詰めた後に、領域をまたいだ物体を移動先の領域に並べ替える
+    if (domains != NULL) {
+      domains->numobj = objnum;
+      if (migrate_domains(domains, cond)) neighbors.valid = 0;
+    }
+    perf_end(&counters, PHASE_FUSION, objnum);
+
+    // 空間的に近い物体がメモリ上でも近くなるように、ときどきMortonコードの順に並べ替える
+    // (複数プロセスのときは領域ごとに並べ替える。どちらでも融合の候補のリストは作り直す)
+    if (sort_every > 0 && (i + 1) % sort_every == 0) {
+      perf_begin(&counters);
+      if (domains != NULL) {
+        for (int d=0; d<domains->nproc; d++) {
+          morton_sort(objects + domains->start[d], domains->count[d], cond);
+        }
+      } else {
+        morton_sort(objects, objnum, cond);
+      }
+      neighbors.valid = 0;
+      massive.valid = 0;
+      cells_valid = 0;
+      perf_end(&counters, PHASE_SORT, objnum);
+    }
     
     // 表示の座標系は width/2, height/2 のピクセル位置が原点となるようにする
-    line += my_plot_objects(objects, objnum, t, cond);
+    perf_begin(&counters);
+    update_id_map(objects, objnum, index_of, numids);
+    line += my_plot_objects(objects, objnum, cells_valid ? cells : NULL, index_of, numids, t, cond);
+    perf_end(&counters, PHASE_RENDER, objnum);
+    if (domains != NULL) {
+      printf("domains:");
+      for (int d=0; d<domains->nproc; d++) {
+        printf(" %zu", domains->count[d]);
+      }
+      printf(" \r\n");
+      line++;
+    }
     
+    // トレースするときは、端末への書き出しにかかる時間が表示の段階に紛れないように、ここで書き出しておく
+    if (trace_file != NULL) {
+      const uint64_t flush_start = trace_begin();
+      fflush(stdout);
+      trace_end(TRACE_FLUSH, flush_start, line);
+    }
+
     // 200 x 1000us = 200 ms ずつ停止
     // ただし、時間の刻み幅が小さいときはそれに合わせて時間を短くする
+    const uint64_t sleep_start = trace_begin();
     usleep(200 * 1000 * cond.dt);
+    trace_end(TRACE_SLEEP, sleep_start, 0);
     printf("\e[%dA", line); // カーソルを表示した分だけ上に戻す
+    last_line = line;
     line = 0;
+    trace_end(TRACE_STEP, step_start, objnum);
+  }
+
+  if (trace_file != NULL) trace_close(&tracer);
+
+  if (perf || events) printf("\e[%dB", last_line); // 最後の表示の下に出す
+  if (events) {
+    printf("fusion events: predicted %zu, stale %zu, checked %zu pairs, fused %zu\r\n",
+      queue.predicted, queue.stale, queue.checked, queue.fused);
+  }
+  if (perf) {
+    perf_report(&counters);
+    perf_close(&counters);
+  }
+
+  free_neighbor_list(&neighbors);
+  free_event_queue(&queue);
+  free_massive(&massive);
+  free_bodies(&cell_memory);
+  free(index_of);
+  if (domains != NULL) {
+    destroy_domains(domains);
+  } else {
+    free_bodies(&object_memory);
   }
   return EXIT_SUCCESS;
 }
 
-int my_plot_objects(Object objs[], const size_t numobj, const double t, const Condition cond) {
+int my_plot_objects(Object objs[], const size_t numobj, const int cell[], const int index_of[], const size_t numids, const double t, const Condition cond) {
 
   int line = 0;
 
@@ -79,14 +485,74 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
   }
 
   // 物体
-  for (int i=0; i<numobj; i++) {
-    int y = objs[i].y + cond.height/2 + 1;
-    int x = objs[i].x + cond.width/2 + 1;
-    if (0 <= y && y < cond.height+2 && 0 <= x && x < cond.width+2) {
-      board[y][x] = 'o';
+  // 各マスの物体数(-wなら質量の合計)をスレッドごとに別の配列に数えてから合計する
+  const int cells = (cond.height+2) * (cond.width+2);
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  double *hist = calloc((size_t)nthreads * cells, sizeof(double));
+  if (hist == NULL) {
+    fprintf(stderr, "Couldn't allocate histogram\r\n");
+    exit(-1);
+  }
+
+#pragma omp parallel
+  {
+    int tid = 0;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+#endif
+    double *mine = hist + (size_t)tid * cells;
+    const uint64_t traced = trace_begin();
+    size_t binned = 0;
+
+#pragma omp for nowait
+    for (int i=0; i<numobj; i++) {
+      // fused_stepで求めてあればそのマスを使う(物体数で数えるときは物体を読まずに済む)
+      int c = cell != NULL ? cell[i] : screen_cell(objs[i].y, objs[i].x, cond);
+      if (c >= 0) {
+        mine[c] += cond.shade_mass ? objs[i].m : 1;
+      }
+      binned++;
+    }
+    trace_end(TRACE_PLOT_BINS, traced, binned);
+#pragma omp barrier
+
+#pragma omp for
+    for (int c=0; c<cells; c++) {
+      for (int k=1; k<nthreads; k++) {
+        hist[c] += hist[(size_t)k * cells + c];
+      }
+    }
+  }
+
+  double max = 0;
+  for (int c=0; c<cells; c++) {
+    if (hist[c] > max) max = hist[c];
+  }
+
+  // 濃淡は対数で段階に分ける。1マスに1個ずつしかないときは今まで通り'o'で表示する
+  const int levels = sizeof(shade_chars) - 1;
+  int shade[cond.height+2][cond.width+2];
+  for (int y=0; y<cond.height+2; y++) {
+    for (int x=0; x<cond.width+2; x++) {
+      double v = hist[y * (cond.width+2) + x];
+      shade[y][x] = -1;
+      if (v <= 0) continue;
+
+      if (!cond.shade_mass && max <= 1) {
+        board[y][x] = 'o';
+        shade[y][x] = levels - 1;
+      } else {
+        shade[y][x] = (max > 1 ? log(1 + v) / log(1 + max) : 1) * (levels - 1) + 0.5;
+        board[y][x] = shade_chars[shade[y][x]];
+      }
     }
   }
 
+  free(hist);
+
   // 四隅の +
   board[0][0] = board[0][cond.width+1] = board[cond.height+1][0] = board[cond.height+1][cond.width+1] = '+';
 
@@ -105,7 +571,12 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
   // boardを表示
   for (int y=0; y<cond.height+2; y++) {
     for (int x=0; x<cond.width+2; x++) {
-      printf("%c", board[y][x]);
+      if (cond.color && 1 <= y && y <= cond.height && 1 <= x && x <= cond.width && shade[y][x] >= 0) {
+        // グレースケールの232(黒)〜255(白)のうち明るい側を使う
+        printf("\e[38;5;%dm%c\e[0m", 240 + shade[y][x] * 15 / (levels - 1), board[y][x]);
+      } else {
+        printf("%c", board[y][x]);
+      }
     }
     printf("\r\n");
   }
@@ -115,8 +586,13 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
   //情報を表示
   printf("t = %4.1lf, cor = %0.2lf numobj = %zu \r\n", t, cond.cor, numobj);
   line++;
-  for (int i=0; i<8 && i<numobj; i++) {
-    printf("obj[%d].y = %6.2lf, objs[%d].x = %6.2lf \r\n", i, objs[i].y, i, objs[i].x);
+  // 並べ替えや融合で位置が変わっても、番号の小さい順に残っている物体を表示する
+  int shown = 0;
+  for (size_t id=0; id<numids && shown<8; id++) {
+    const int i = index_of[id];
+    if (i < 0) continue;
+    printf("obj[%zu].y = %6.2lf, objs[%zu].x = %6.2lf \r\n", id, objs[i].y, id, objs[i].x);
+    shown++;
     line++;
   }
 
@@ -126,11 +602,18 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
 
 
 void my_update_velocities(Object objs[], const size_t numobj, const Condition cond) {
+  my_update_velocities_range(objs, numobj, 0, numobj, cond);
+}
+
+void my_update_velocities_range(Object objs[], const size_t numobj, const size_t begin, const size_t end, const Condition cond) {
 
   // 速度を更新
-  for (int i=0; i<numobj; i++) {
+  for (int i=begin; i<end; i++) {
     for (int j=0; j<numobj; j++) {
       if (i == j) continue;
+      // 近接遭遇中の相手からの力はmy_update_positionsで正則化して扱う
+      // (partnerはfind_encountersに渡した範囲の先頭からのインデックス)
+      if (objs[i].partner >= 0 && begin + objs[i].partner == j) continue;
 
       double dist = sqrt(pow(objs[i].y - objs[j].y, 2) + pow(objs[i].x - objs[j].x, 2));
       objs[i].vy += cond.G * objs[j].m * (objs[j].y - objs[i].y) / pow(dist, 3) * cond.dt;
@@ -140,6 +623,86 @@ void my_update_velocities(Object objs[], const size_t numobj, const Condition co
 }
 
 
+void update_velocities_plan(Object objs[], const size_t numobj, const size_t begin, const size_t end, const ForcePlan *plan, const Condition cond) {
+
+  if (plan->method == FORCE_DIRECT) {
+    // iごとに足す順番はmy_update_velocities_rangeと同じなので、iをスレッドで分けても結果は変わらない
+#pragma omp parallel num_threads(plan->threads)
+    {
+      const uint64_t traced = trace_begin();
+      size_t mine = 0;
+#pragma omp for schedule(static) nowait
+      for (size_t i=begin; i<end; i++) {
+        mine++;
+        for (size_t j=0; j<numobj; j++) {
+          if (i == j) continue;
+          if (objs[i].partner >= 0 && begin + objs[i].partner == j) continue;
+
+          double dist = sqrt(pow(objs[i].y - objs[j].y, 2) + pow(objs[i].x - objs[j].x, 2));
+          objs[i].vy += cond.G * objs[j].m * (objs[j].y - objs[i].y) / pow(dist, 3) * cond.dt;
+          objs[i].vx += cond.G * objs[j].m * (objs[j].x - objs[i].x) / pow(dist, 3) * cond.dt;
+        }
+      }
+      trace_end(TRACE_FORCE_ROWS, traced, mine);
+    }
+    return;
+  }
+
+  // 相手の位置と質量だけを詰めた配列に写し、tile個ずつのタイルを自分の分の全てのiで使い回す
+  // (各iではjを小さい順に足すので、結果はmy_update_velocities_rangeと変わらない)
+  double *m = malloc(sizeof(double) * (numobj + 1));
+  double *y = malloc(sizeof(double) * (numobj + 1));
+  double *x = malloc(sizeof(double) * (numobj + 1));
+  if (m == NULL || y == NULL || x == NULL) {
+    fprintf(stderr, "Couldn't allocate force tiles\r\n");
+    exit(-1);
+  }
+  const size_t tile = plan->tile;
+
+#pragma omp parallel num_threads(plan->threads)
+  {
+#pragma omp for schedule(static)
+    for (size_t j=0; j<numobj; j++) {
+      m[j] = objs[j].m;
+      y[j] = objs[j].y;
+      x[j] = objs[j].x;
+    }
+
+    // タイルごとに待ち合わせないように、iの範囲は自分で分ける
+    int tid = 0, nthreads = 1;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+    nthreads = omp_get_num_threads();
+#endif
+    const size_t lo = begin + (end - begin) * tid / nthreads;
+    const size_t hi = begin + (end - begin) * (tid + 1) / nthreads;
+    const uint64_t traced = trace_begin();
+
+    for (size_t jb=0; jb<numobj; jb+=tile) {
+      const size_t je = numobj - jb < tile ? numobj : jb + tile;
+      for (size_t i=lo; i<hi; i++) {
+        const double yi = objs[i].y, xi = objs[i].x;
+        const size_t skip = objs[i].partner >= 0 ? begin + objs[i].partner : i;
+        double vy = objs[i].vy, vx = objs[i].vx;
+        for (size_t j=jb; j<je; j++) {
+          if (j == i || j == skip) continue;
+
+          double dist = sqrt(pow(yi - y[j], 2) + pow(xi - x[j], 2));
+          vy += cond.G * m[j] * (y[j] - yi) / pow(dist, 3) * cond.dt;
+          vx += cond.G * m[j] * (x[j] - xi) / pow(dist, 3) * cond.dt;
+        }
+        objs[i].vy = vy;
+        objs[i].vx = vx;
+      }
+    }
+    trace_end(TRACE_FORCE_ROWS, traced, hi - lo);
+  }
+
+  free(m);
+  free(y);
+  free(x);
+}
+
 void my_update_positions(Object objs[], const size_t numobj, const Condition cond) {
 
   // 現在の位置をprev_yに保存してから更新する
@@ -150,48 +713,434 @@ void my_update_positions(Object objs[], const size_t numobj, const Condition con
     objs[i].x += objs[i].vx * cond.dt;
   }
 
+  // 近接遭遇中のペアは重心を直進させ、相対運動を正則化して積分し直す
+  for (int i=0; i<numobj; i++) {
+    if (objs[i].partner > i) {
+      integrate_encounter(&objs[i], &objs[objs[i].partner], cond);
+    }
+  }
+
 }
 
-void my_bounce(Object objs[], const size_t numobj, const Condition cond) {
+size_t find_encounters(Object objs[], const size_t numobj, const Condition cond) {
+
+  for (int i=0; i<numobj; i++) {
+    objs[i].partner = -1;
+  }
+  if (cond.encounter <= 0) return 0;
+
+  // 自由落下時間 sqrt(r^3 / GM) が encounter * dt より短い相手のうち最も近いものを候補とする
+  int *nearest = malloc(sizeof(int) * numobj);
+  if (nearest == NULL) {
+    fprintf(stderr, "Couldn't allocate encounter table\r\n");
+    exit(-1);
+  }
+  for (int i=0; i<numobj; i++) {
+    nearest[i] = -1;
+    double nearest_dist = INFINITY;
+    for (int j=0; j<numobj; j++) {
+      if (i == j) continue;
+
+      double dist = sqrt(pow(objs[i].y - objs[j].y, 2) + pow(objs[i].x - objs[j].x, 2));
+      double gm = cond.G * (objs[i].m + objs[j].m);
+      if (dist > 0 && pow(dist, 3) < pow(cond.encounter * cond.dt, 2) * gm && dist < nearest_dist) {
+        nearest[i] = j;
+        nearest_dist = dist;
+      }
+    }
+  }
 
+  // 互いに最も近い相手同士だけをペアにする(一つの物体が複数のペアに入らないように)
+  size_t pairs = 0;
   for (int i=0; i<numobj; i++) {
+    int j = nearest[i];
+    if (j >= 0 && nearest[j] == i) {
+      objs[i].partner = j;
+      pairs += j > i;
+    }
+  }
+
+  free(nearest);
+  return pairs;
+
+}
+
+void gather_massive(const Object objs[], const size_t numobj, MassiveBodies *mb) {
+
+  // 融合や並べ替えで並びが変わったときだけ選び直す(融合で質量が増えてテスト粒子でなくなることもある)
+  if (!mb->valid || mb->numobj != numobj) {
+    size_t count = 0;
+    for (size_t i=0; i<numobj; i++) {
+      count += objs[i].m > mb->cutoff;
+    }
+    if (count > mb->capacity) {
+      mb->index = realloc(mb->index, sizeof(int) * count);
+      mb->m = realloc(mb->m, sizeof(double) * count);
+      mb->y = realloc(mb->y, sizeof(double) * count);
+      mb->x = realloc(mb->x, sizeof(double) * count);
+      if (mb->index == NULL || mb->m == NULL || mb->y == NULL || mb->x == NULL) {
+        fprintf(stderr, "Couldn't allocate massive bodies\r\n");
+        exit(-1);
+      }
+      mb->capacity = count;
+    }
+    mb->count = 0;
+    for (size_t i=0; i<numobj; i++) {
+      if (objs[i].m > mb->cutoff) mb->index[mb->count++] = i;
+    }
+    mb->numobj = numobj;
+    mb->valid = 1;
+  }
+
+  for (size_t a=0; a<mb->count; a++) {
+    const Object *o = &objs[mb->index[a]];
+    mb->m[a] = o->m;
+    mb->y[a] = o->y;
+    mb->x[a] = o->x;
+  }
+
+}
+
+void free_massive(MassiveBodies *mb) {
+  free(mb->index);
+  free(mb->m);
+  free(mb->y);
+  free(mb->x);
+  *mb = (MassiveBodies) {.cutoff = mb->cutoff};
+}
+
+size_t find_massive_encounters(Object objs[], const MassiveBodies *mb, const Condition cond) {
+
+  // テスト粒子のpartnerはupdate_velocities_testで-1にする
+  const size_t count = mb->count;
+  for (size_t a=0; a<count; a++) {
+    objs[mb->index[a]].partner = -1;
+  }
+  if (cond.encounter <= 0 || count == 0) return 0;
+
+  int *nearest = malloc(sizeof(int) * count);
+  if (nearest == NULL) {
+    fprintf(stderr, "Couldn't allocate encounter table\r\n");
+    exit(-1);
+  }
+  for (size_t a=0; a<count; a++) {
+    nearest[a] = -1;
+    double nearest_dist = INFINITY;
+    for (size_t b=0; b<count; b++) {
+      if (a == b) continue;
+
+      double dist = sqrt(pow(mb->y[a] - mb->y[b], 2) + pow(mb->x[a] - mb->x[b], 2));
+      double gm = cond.G * (mb->m[a] + mb->m[b]);
+      if (dist > 0 && pow(dist, 3) < pow(cond.encounter * cond.dt, 2) * gm && dist < nearest_dist) {
+        nearest[a] = b;
+        nearest_dist = dist;
+      }
+    }
+  }
+
+  // index[]は小さい順なので、b > a ならobjs[]の中でも後ろにある
+  size_t pairs = 0;
+  for (size_t a=0; a<count; a++) {
+    int b = nearest[a];
+    if (b >= 0 && nearest[b] == (int)a) {
+      objs[mb->index[a]].partner = mb->index[b];
+      pairs += b > (int)a;
+    }
+  }
+
+  free(nearest);
+  return pairs;
+
+}
+
+void update_velocities_test(Object objs[], const size_t numobj, const MassiveBodies *mb, const Condition cond) {
+
+  const size_t count = mb->count;
+  const double *my = mb->y, *mx = mb->x, *mm = mb->m;
+
+  // 力の源になる物体同士は、my_update_velocities_rangeと同じ式で近接遭遇の相手以外から受ける力を足す
+#pragma omp parallel for schedule(dynamic, 16)
+  for (size_t a=0; a<count; a++) {
+    Object *o = &objs[mb->index[a]];
+    for (size_t b=0; b<count; b++) {
+      if (b == a || mb->index[b] == o->partner) continue;
+
+      double dist = sqrt(pow(o->y - my[b], 2) + pow(o->x - mx[b], 2));
+      o->vy += cond.G * mm[b] * (my[b] - o->y) / pow(dist, 3) * cond.dt;
+      o->vx += cond.G * mm[b] * (mx[b] - o->x) / pow(dist, 3) * cond.dt;
+    }
+  }
 
-    // 画面端を横切った場合
-    if (in_screen(objs[i].prev_y, objs[i].prev_x, cond) != in_screen(objs[i].y, objs[i].x, cond)) {
+  // テスト粒子はまとまりごとに位置を手元の配列に写し、力の源の物体を1つずつ全員にまとめて足す
+  // (内側のループはテスト粒子の並びなので、力の源が数個しかなくてもSIMDのレーンが埋まる)
+  // まとまりに混じった力の源の物体も計算はするが、自分自身との距離が0になるので結果は捨てる
+  const double cutoff = mb->cutoff;
+  const double kick = cond.G * cond.dt;
+#pragma omp parallel
+  {
+    const uint64_t traced = trace_begin();
+    size_t mine = 0;
+#pragma omp for schedule(static) nowait
+    for (size_t begin=0; begin<numobj; begin+=BOUNCE_CHUNK) {
+      const size_t n = numobj - begin < BOUNCE_CHUNK ? numobj - begin : BOUNCE_CHUNK;
+      Object *chunk = objs + begin;
+      double ty[BOUNCE_CHUNK], tx[BOUNCE_CHUNK], ay[BOUNCE_CHUNK], ax[BOUNCE_CHUNK];
+      mine += n;
 
-      // 下の壁の座標をprev_yとyで挟んでいる場合
-      // つまり、下の壁を通過した場合(上からでも下からでも)
-      if (is_monotonic(objs[i].prev_y, cond.height/2, objs[i].y)) {
-        // 画面内から画面外なら (objs[i].y - cond.height/2) > 0
-        objs[i].y = cond.height/2 - (objs[i].y - cond.height/2) * cond.cor;
-        objs[i].vy *= -cond.cor;
+      for (size_t i=0; i<n; i++) {
+        ty[i] = chunk[i].y;
+        tx[i] = chunk[i].x;
+        ay[i] = 0;
+        ax[i] = 0;
       }
 
-      // 上の壁を通過した場合(上からでも下からでも)
-      if (is_monotonic(objs[i].prev_y, -cond.height/2, objs[i].y)) {
-        objs[i].y = -cond.height/2 + (-cond.height/2 - objs[i].y) * cond.cor;
-        objs[i].vy *= -cond.cor;
+      for (size_t b=0; b<count; b++) {
+        const double yb = my[b], xb = mx[b], mass = mm[b];
+#pragma omp simd
+        for (size_t i=0; i<n; i++) {
+          const double dy = yb - ty[i], dx = xb - tx[i];
+          const double r2 = dy * dy + dx * dx;
+          const double s = mass / (r2 * sqrt(r2));
+          ay[i] += s * dy;
+          ax[i] += s * dx;
+        }
       }
 
-      // 右の壁
-      if (is_monotonic(objs[i].prev_x, cond.width/2, objs[i].x)) {
-        objs[i].x = cond.width/2 - (objs[i].x - cond.width/2) * cond.cor;
-        objs[i].vx *= -cond.cor;
+      for (size_t i=0; i<n; i++) {
+        const int test = chunk[i].m <= cutoff;
+        chunk[i].vy += test ? kick * ay[i] : 0;
+        chunk[i].vx += test ? kick * ax[i] : 0;
+        chunk[i].partner = test ? -1 : chunk[i].partner;
       }
+    }
+    trace_end(TRACE_TEST_PARTICLES, traced, mine);
+  }
+
+}
+
+// logH法の1ステップ(drift-kick-drift)を仮想時間hだけ進め、経過した実時間を返す
+static double encounter_step(double *ry, double *rx, double *vy, double *vx, const double h, const double b, const double gm) {
+
+  double tau = h / 2 / fmax((*vy * *vy + *vx * *vx) / 2 + b, 1e-300);
+  double elapsed = tau;
+  *ry += *vy * tau;
+  *rx += *vx * tau;
+
+  const double r = sqrt(*ry * *ry + *rx * *rx);
+  tau = h * r / gm;
+  *vy -= gm * *ry / pow(r, 3) * tau;
+  *vx -= gm * *rx / pow(r, 3) * tau;
+
+  tau = h / 2 / fmax((*vy * *vy + *vx * *vx) / 2 + b, 1e-300);
+  elapsed += tau;
+  *ry += *vy * tau;
+  *rx += *vx * tau;
+
+  return elapsed;
+}
+
+void integrate_encounter(Object *o1, Object *o2, const Condition cond) {
+
+  double m = o1->m + o2->m;
+  double gm = cond.G * m;
+
+  // 重心と相対座標に分ける。重心は外力なしで直進する
+  double cy = (o1->m * o1->prev_y + o2->m * o2->prev_y) / m;
+  double cx = (o1->m * o1->prev_x + o2->m * o2->prev_x) / m;
+  double cvy = (o1->m * o1->vy + o2->m * o2->vy) / m;
+  double cvx = (o1->m * o1->vx + o2->m * o2->vx) / m;
+  cy += cvy * cond.dt;
+  cx += cvx * cond.dt;
+
+  double ry = o2->prev_y - o1->prev_y, rx = o2->prev_x - o1->prev_x;
+  double vy = o2->vy - o1->vy, vx = o2->vx - o1->vx;
+
+  // logH法: 仮想時間sで一定幅ずつ進め、実時間は dt/ds = 1/(T+B) (drift), r/GM (kick) で決まる
+  // 二体問題なら軌道はdsによらず正確に保たれ、誤差は時間方向だけに入る
+  double r = sqrt(ry * ry + rx * rx);
+  double b = gm / r - (vy * vy + vx * vx) / 2; // B = -(エネルギー)
+  double ds = 2 * M_PI / 64 * sqrt(gm * r); // 1周あたり64ステップ程度
+  double time = 0;
+
+  for (int step = 0; step < 100000 && cond.dt - time > 1e-12 * cond.dt; step++) {
+
+    // 仮想時間の幅hで1ステップ進めてみて、残り時間を超えたらhを縮めてやり直す
+    // (経過時間はhにほぼ比例するので比で縮める。速く離れていくペアでは T+B が桁落ちで0近くになり、
+    //  1回で大きく進みすぎることがあるが、そのときもhごと縮めるのでdriftとkickの仮想時間は揃ったままになる)
+    const double rest = cond.dt - time;
+    double h = fmin(ds, rest * gm / r);
+    double ny, nx, nvy, nvx, elapsed;
+    for (int retry = 0; retry < 64; retry++) {
+      ny = ry, nx = rx, nvy = vy, nvx = vx;
+      elapsed = encounter_step(&ny, &nx, &nvy, &nvx, h, b, gm);
+      if (elapsed <= rest) break;
+      h *= retry < 4 ? rest / elapsed : 0.5;
+    }
+    if (!(elapsed <= rest)) break; // 縮めても収まらなければ、残りは下で直線で進める
+    ry = ny, rx = nx, vy = nvy, vx = nvx;
+    time += elapsed;
+    r = sqrt(ry * ry + rx * rx);
+  }
+
+  // 縮めたhで少し手前に着いたときや、ステップ数の上限で打ち切ったときは、残りの時間を直線で進めて他の物体に揃える
+  if (time < cond.dt) {
+    ry += vy * (cond.dt - time);
+    rx += vx * (cond.dt - time);
+  }
 
-      // 左の壁
-      if (is_monotonic(objs[i].prev_x, -cond.width/2, objs[i].x)) {
-        objs[i].x = -cond.width/2 + (-cond.width/2 - objs[i].x) * cond.cor;
-        objs[i].vx *= -cond.cor;
+  o1->y = cy - o2->m / m * ry;
+  o1->x = cx - o2->m / m * rx;
+  o2->y = cy + o1->m / m * ry;
+  o2->x = cx + o1->m / m * rx;
+  o1->vy = cvy - o2->m / m * vy;
+  o1->vx = cvx - o2->m / m * vx;
+  o2->vy = cvy + o1->m / m * vy;
+  o2->vx = cvx + o1->m / m * vx;
+
+}
+
+// objs[0]〜objs[count-1] (count <= BOUNCE_CHUNK)のうち画面端を横切った物体を折り返す
+static void bounce_chunk(Object objs[], const size_t count, const Condition cond) {
+
+  // 壁の座標と反発係数はループの外で取り出しておく
+  const double bottom = cond.height / 2, top = -cond.height / 2;
+  const double right = cond.width / 2, left = -cond.width / 2;
+  const double cor = cond.cor;
+
+  // 画面端を横切る物体はわずかなので、読むだけの判定と、横切った物体だけの反射に分ける
+  // (全部に書き戻すと書き込みの帯域を使ってしまう。どちらのループにも分岐はない)
+
+  // 画面内外が入れ替わったかどうか(画面外から画面内に入る場合も含む)
+  // 比較は && や || ではなく & と | でつなぐ
+  unsigned char crossed[BOUNCE_CHUNK];
+#pragma omp simd
+  for (size_t i=0; i<count; i++) {
+    const int was_in = (top <= objs[i].prev_y) & (objs[i].prev_y <= bottom) & (left <= objs[i].prev_x) & (objs[i].prev_x <= right);
+    const int is_in = (top <= objs[i].y) & (objs[i].y <= bottom) & (left <= objs[i].x) & (objs[i].x <= right);
+    crossed[i] = was_in ^ is_in;
+  }
+
+  // 横切った物体の番号を詰める(番号は毎回書き、横切ったときだけ次に進む)
+  unsigned short hits[BOUNCE_CHUNK];
+  size_t nhits = 0;
+  for (size_t i=0; i<count; i++) {
+    hits[nhits] = i;
+    nhits += crossed[i];
+  }
+
+  for (size_t k=0; k<nhits; k++) {
+    Object *o = &objs[hits[k]];
+    const double prev_y = o->prev_y, prev_x = o->prev_x;
+    double y = o->y, x = o->x, vy = o->vy, vx = o->vx;
+
+    // 下の壁の座標をprev_yとyで挟んでいる場合(上からでも下からでも)
+    int hit = ((prev_y <= bottom) & (bottom <= y)) | ((y <= bottom) & (bottom <= prev_y));
+    y = hit ? bottom - (y - bottom) * cor : y;
+    vy = hit ? vy * -cor : vy;
+
+    // 上の壁(下の壁で折り返した後の位置で判定する)
+    hit = ((prev_y <= top) & (top <= y)) | ((y <= top) & (top <= prev_y));
+    y = hit ? top + (top - y) * cor : y;
+    vy = hit ? vy * -cor : vy;
+
+    // 右の壁
+    hit = ((prev_x <= right) & (right <= x)) | ((x <= right) & (right <= prev_x));
+    x = hit ? right - (x - right) * cor : x;
+    vx = hit ? vx * -cor : vx;
+
+    // 左の壁
+    hit = ((prev_x <= left) & (left <= x)) | ((x <= left) & (left <= prev_x));
+    x = hit ? left + (left - x) * cor : x;
+    vx = hit ? vx * -cor : vx;
+
+    o->y = y;
+    o->x = x;
+    o->vy = vy;
+    o->vx = vx;
+  }
+
+}
+
+void my_bounce(Object objs[], const size_t numobj, const Condition cond) {
+
+  for (size_t begin=0; begin<numobj; begin+=BOUNCE_CHUNK) {
+    const size_t count = numobj - begin < BOUNCE_CHUNK ? numobj - begin : BOUNCE_CHUNK;
+    bounce_chunk(objs + begin, count, cond);
+  }
+
+}
+
+int screen_cell(const double y, const double x, const Condition cond) {
+  int cy = y + cond.height/2 + 1;
+  int cx = x + cond.width/2 + 1;
+  if (0 <= cy && cy < cond.height+2 && 0 <= cx && cx < cond.width+2) return cy * (cond.width+2) + cx;
+  return -1;
+}
+
+double fused_step(Object objs[], const size_t numobj, const size_t pairs, NeighborList *list, int cell[], const Condition cond) {
+
+  // 近接遭遇中のペアは先に動かしておく(相手が別のまとまりにいても、動かす前の位置から積分できるように)
+  if (pairs > 0) {
+    for (size_t i=0; i<numobj; i++) {
+      if (objs[i].partner > (int)i) {
+        Object *o1 = &objs[i], *o2 = &objs[o1->partner];
+        o1->prev_y = o1->y;
+        o1->prev_x = o1->x;
+        o2->prev_y = o2->y;
+        o2->prev_x = o2->x;
+        integrate_encounter(o1, o2, cond);
       }
     }
+  }
+
+  // 融合の候補のリストが今の物体の並びのものなら、作り直したときからの移動距離と、融合するかもしれない物体の印も求める
+  const int track = list->valid && list->numobj == numobj;
+  double max_disp2 = 0;
+
+  // キャッシュに収まる大きさのまとまりごとに、移動・反射・移動距離・表示するマスをまとめて求める
+  // (-tのときはスレッドごとに自分の分にかかった時間を記録するので、ループの終わりでは待たない)
+#pragma omp parallel reduction(max:max_disp2)
+  {
+    const uint64_t traced = trace_begin();
+    size_t mine = 0;
+#pragma omp for schedule(static) nowait
+    for (size_t begin=0; begin<numobj; begin+=BOUNCE_CHUNK) {
+      const size_t count = numobj - begin < BOUNCE_CHUNK ? numobj - begin : BOUNCE_CHUNK;
+      Object *chunk = objs + begin;
+      mine += count;
+
+      for (size_t i=0; i<count; i++) {
+        const int drifting = chunk[i].partner < 0;
+        chunk[i].prev_y = drifting ? chunk[i].y : chunk[i].prev_y;
+        chunk[i].prev_x = drifting ? chunk[i].x : chunk[i].prev_x;
+        chunk[i].y = drifting ? chunk[i].y + chunk[i].vy * cond.dt : chunk[i].y;
+        chunk[i].x = drifting ? chunk[i].x + chunk[i].vx * cond.dt : chunk[i].x;
+      }
+
+      bounce_chunk(chunk, count, cond);
 
+      for (size_t i=0; i<count; i++) {
+        if (track) {
+          double d2 = pow(chunk[i].y - list->ref_y[begin + i], 2) + pow(chunk[i].x - list->ref_x[begin + i], 2);
+          if (d2 > max_disp2) max_disp2 = d2;
+          // 相手が余裕の半分までしか動いていなければ、自分が余裕(slack)以上動いていない限り閾値より近づけない
+          const double slack = list->slack[begin + i];
+          list->candidate[begin + i] = (slack < 0) | (d2 > slack * slack);
+        }
+        cell[begin + i] = screen_cell(chunk[i].y, chunk[i].x, cond);
+      }
+    }
+    trace_end(TRACE_FUSED_STEP, traced, mine);
   }
 
+  return track ? max_disp2 : -1;
 }
 
 void load_objects(size_t numobj, Object objs[], char filename[], const Condition cond) {
 
+  // ファイルではなく生成器の名前が指定された場合
+  if (generate_objects(filename, 0, numobj, objs, cond)) return;
+
   FILE *fp = fopen(filename, "r");
   if (fp == NULL) {
     fprintf(stderr, "Couldn't open '%s'\r\n", filename);
@@ -200,29 +1149,23 @@ void load_objects(size_t numobj, Object objs[], char filename[], const Condition
 
   int buffer_len = 1000;
   char buffer[buffer_len];
-  int i = 0; //objsのインデックス
+  size_t i = 0; //objsのインデックス
   while (i < numobj && (fgets(buffer, buffer_len-1, fp)) != NULL) {
 
     // #で始まる行はコメント
     if (buffer[0] == '#') continue;
 
     sscanf(buffer, "%lf %lf %lf %lf %lf", &objs[i].m, &objs[i].x, &objs[i].y, &objs[i].vx, &objs[i].vy);
+    objs[i].id = i;
 
     i++;
   }
 
-  // 足りない分はランダム生成
-  while (i < numobj) {
-    objs[i].m = (double)rand() / RAND_MAX * 40 + 40;
-    objs[i].x = (double)rand() / RAND_MAX * cond.width - cond.width / 2;
-    objs[i].y = (double)rand() / RAND_MAX * cond.height - cond.height / 2;
-    objs[i].vx = (double)rand() / RAND_MAX * 20 - 10;
-    objs[i].vy = (double)rand() / RAND_MAX * 20 - 10;
-    i++;
-  }
+  // 足りない分はランダム生成(乱数はインデックスで決まるので、ファイルの物体数によらず同じ値になる)
+  generate_objects("uniform", i, numobj, objs, cond);
 
-  // 初期値を表示
-  for (int j=0; j<numobj; j++) {
+  // 初期値を表示(多すぎるときは種から再現できるので表示しない)
+  for (int j=0; j<numobj && numobj <= 1000; j++) {
     printf("%.16lf %.16lf %.16lf %.16lf %.16lf\r\n", objs[j].m, objs[j].x, objs[j].y, objs[j].vx, objs[j].vy);
   }
 
@@ -230,54 +1173,1877 @@ void load_objects(size_t numobj, Object objs[], char filename[], const Condition
 
 }
 
-void fusion_objects(Object objs[], size_t *numobj, const Condition cond) {
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+// カウンタとキーだけから乱数が決まるので、どの順番・どのスレッドで生成しても結果が変わらない
+void philox4x32(uint32_t ctr[4], const uint32_t key[2]) {
 
-  double threshold = 2; // 融合する距離の閾値
-  int count = 0; // 融合した回数(3個が1つになった場合は2回とカウントする)
+  uint32_t k0 = key[0], k1 = key[1];
 
-  for (int i=0; i<*numobj; i++) {
-    for (int j=i+1; j<*numobj; j++) {
+  for (int round = 0; round < 10; round++) {
+    uint64_t p0 = (uint64_t)0xD2511F53 * ctr[0];
+    uint64_t p1 = (uint64_t)0xCD9E8D57 * ctr[2];
+    uint32_t c1 = ctr[1], c3 = ctr[3];
+    ctr[0] = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+    ctr[1] = (uint32_t)p1;
+    ctr[2] = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+    ctr[3] = (uint32_t)p0;
+    k0 += 0x9E3779B9;
+    k1 += 0xBB67AE85;
+  }
+
+}
 
-        double dist = sqrt(pow(objs[i].y - objs[j].y, 2) + pow(objs[i].x - objs[j].x, 2));
+double random_uniform(const unsigned long seed, const uint64_t index, const uint32_t k) {
 
-        if (dist < threshold) {
-          // 合成後の位置は中点
-          objs[j].y = (objs[i].y + objs[j].y) / 2;
-          objs[j].x = (objs[i].x + objs[j].x) / 2;
-          // 運動量保存から速度を求める
-          objs[j].vy = (objs[i].m * objs[i].vy + objs[j].m * objs[j].vy) / (objs[i].m + objs[j].m);
-          objs[j].vx = (objs[i].m * objs[i].vx + objs[j].m * objs[j].vx) / (objs[i].m + objs[j].m);
+  // 1回の計算で128ビット得られるので、k番目とk^1番目で半分ずつ使う
+  uint32_t ctr[4] = {(uint32_t)index, (uint32_t)(index >> 32), k / 2, 0};
+  const uint32_t key[2] = {(uint32_t)seed, (uint32_t)((uint64_t)seed >> 32)};
+  philox4x32(ctr, key);
 
-          objs[j].m += objs[i].m;
+  uint64_t bits = k % 2 == 0 ? ((uint64_t)ctr[0] << 32 | ctr[1]) : ((uint64_t)ctr[2] << 32 | ctr[3]);
 
-          count++;
+  // 上位53ビットを使って(0, 1)の一様乱数にする
+  return ((bits >> 11) + 0.5) / 9007199254740992.0;
+}
 
-          // インデックスの小さい方を後で消滅させるためにm=0としておき、これ以降参照しないようにbreakする
-          objs[i].m = 0;
-          break;
-        }
+int generate_objects(const char *kind, const size_t begin, const size_t numobj, Object objs[], const Condition cond) {
 
+  const unsigned long seed = cond.seed;
+  const double total_mass = 6000; // plummer, diskの全質量(物体数によらず同じ重力の強さになるようにする)
+
+  if (strcmp(kind, "uniform") == 0) {
+
+    // 画面全体に一様に配置する
+#pragma omp parallel for
+    for (size_t i=begin; i<numobj; i++) {
+      objs[i] = (Object) {
+        .m = random_uniform(seed, i, 0) * 40 + 40,
+        .x = random_uniform(seed, i, 1) * cond.width - cond.width / 2,
+        .y = random_uniform(seed, i, 2) * cond.height - cond.height / 2,
+        .vx = random_uniform(seed, i, 3) * 20 - 10,
+        .vy = random_uniform(seed, i, 4) * 20 - 10,
+        .id = i
+      };
     }
-  }
 
-  // バブルソートの要領で残ったオブジェクトを前に詰める
-  for (int i=*numobj; i>=0; i--) {
-    for (int j=0; j<i; j++) {
-      if (objs[j].m == 0) {
-        objs[j] = objs[j+1];
-        objs[j+1].m = 0;
-      }
+  } else if (strcmp(kind, "plummer") == 0) {
+
+    // プラマー分布の動径分布と速度分布に従って、平面上のランダムな向きに配置する
+    // (Aarseth, Henon & Wielen 1974 の方法)
+    const double a = cond.height / 5.0; // スケール半径
+    const double m = total_mass / (numobj - begin);
+
+#pragma omp parallel for
+    for (size_t i=begin; i<numobj; i++) {
+      // 引き直しにはカウンタ0〜59を使い、向きには60,61を使うので、同じ乱数を2回使うことはない
+      uint32_t k = 0;
+
+      double r;
+      do {
+        r = a / sqrt(pow(random_uniform(seed, i, k++), -2.0 / 3) - 1);
+      } while (r > 10 * a && k < 58); // 遠すぎるものは引き直す(速さを引く分を2つ残す)
+
+      double q, g;
+      do {
+        q = random_uniform(seed, i, k++);
+        g = random_uniform(seed, i, k++) * 0.1;
+      } while (g > q * q * pow(1 - q * q, 3.5) && k + 2 <= 60);
+      double v = q * sqrt(2 * cond.G * total_mass / sqrt(r * r + a * a));
+
+      double theta = 2 * M_PI * random_uniform(seed, i, 60);
+      double phi = 2 * M_PI * random_uniform(seed, i, 61);
+      objs[i] = (Object) {
+        .m = m,
+        .x = r * cos(theta), .y = r * sin(theta),
+        .vx = v * cos(phi), .vy = v * sin(phi),
+        .id = i
+      };
     }
-  }
 
-  *numobj -= count;
-}
+  } else if (strcmp(kind, "disk") == 0) {
 
+    // 面積あたり一様な円環に置き、内側の質量による円運動の速さで反時計回りに回転させる
+    const double r_in = 2, r_out = cond.height / 2.0;
+    const double m = total_mass / (numobj - begin);
 
-int in_screen(double y, double x, const Condition cond) {
-  return -cond.height/2 <= y && y <= cond.height/2 && -cond.width/2 <= x && x <= cond.width/2;
-}
+#pragma omp parallel for
+    for (size_t i=begin; i<numobj; i++) {
+      double r = sqrt(r_in * r_in + (r_out * r_out - r_in * r_in) * random_uniform(seed, i, 0));
+      double theta = 2 * M_PI * random_uniform(seed, i, 1);
+      double enclosed = total_mass * (r * r - r_in * r_in) / (r_out * r_out - r_in * r_in);
+      double v = sqrt(cond.G * enclosed / r) * (0.95 + 0.1 * random_uniform(seed, i, 2)); // 少しだけ速度にばらつきを持たせる
+      objs[i] = (Object) {
+        .m = m,
+        .x = r * cos(theta), .y = r * sin(theta),
+        .vx = -v * sin(theta), .vy = v * cos(theta),
+        .id = i
+      };
+    }
+
+  } else if (strcmp(kind, "sun") == 0) {
+
+    // 0番目を重い太陽にして、残りは軽い物体を円軌道に乗せる
+    // 太陽の質量は、一番内側の円軌道の周期がdtのSUN_PERIOD_STEPS倍になるように決める(内側ほど周期が短い)
+    const double r_in = 5;
+    const double period = SUN_PERIOD_STEPS * cond.dt;
+    const double sun = 4 * M_PI * M_PI * pow(r_in, 3) / (cond.G * period * period);
+    const double m = sun * 1e-3 / (numobj > 1 ? numobj - 1 : 1); // 軽い物体の全質量は太陽の1/1000
+
+    // 最初から融合しないように、閾値の1.25倍の間隔で同心円の輪に並べる(輪ごとに向きをずらす)
+    // 輪が壁で跳ね返らないように、画面に収まる輪を使い切ったら、残りは画面を丸ごと囲む輪に置く
+    const double spacing = 1.25 * cond.threshold;
+    const size_t inner = (size_t)ceil((cond.height / 2.0 - r_in) / spacing); // 画面に収まる輪の数
+    const double r_far = sqrt(pow(cond.width / 2.0, 2) + pow(cond.height / 2.0, 2)) + spacing;
+
+#pragma omp parallel for
+    for (size_t i=begin; i<numobj; i++) {
+      if (i == 0) {
+        objs[i] = (Object) {.m = sun, .id = i};
+        continue;
+      }
+      // 何番目の輪の何番目かを内側から数えて求める
+      size_t k = 0, first = 1;
+      double r = r_in;
+      size_t count = (size_t)(2 * M_PI * r / spacing);
+      while (i >= first + count) {
+        first += count;
+        k++;
+        r = k < inner ? r_in + k * spacing : r_far + (k - inner) * spacing;
+        count = (size_t)(2 * M_PI * r / spacing);
+      }
+      double theta = 2 * M_PI * (i - first + random_uniform(seed, k, 0)) / count;
+      double v = sqrt(cond.G * sun / r);
+      objs[i] = (Object) {
+        .m = m,
+        .x = r * cos(theta), .y = r * sin(theta),
+        .vx = -v * sin(theta), .vy = v * cos(theta),
+        .id = i
+      };
+    }
+
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+// 16ビットの値の各ビットの間に0を挟む(0babcd -> 0b0a0b0c0d)
+static uint32_t spread_bits(uint32_t v) {
+  v = (v | (v << 8)) & 0x00FF00FF;
+  v = (v | (v << 4)) & 0x0F0F0F0F;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+uint32_t morton_code(const double y, const double x, const Condition cond) {
+  // 画面の外に出た物体も少しは区別できるように画面の2倍の範囲を使い、その外は端に寄せる
+  double qy = (y + cond.height) / (2.0 * cond.height) * 65536;
+  double qx = (x + cond.width) / (2.0 * cond.width) * 65536;
+  qy = qy < 0 ? 0 : qy > 65535 ? 65535 : qy;
+  qx = qx < 0 ? 0 : qx > 65535 ? 65535 : qx;
+  return (spread_bits((uint32_t)qy) << 1) | spread_bits((uint32_t)qx);
+}
+
+void radix_sort(uint32_t keys[], uint32_t order[], const size_t n) {
+
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  uint32_t *tmp_keys = malloc(sizeof(uint32_t) * n);
+  uint32_t *tmp_order = malloc(sizeof(uint32_t) * n);
+  size_t *hist = malloc(sizeof(size_t) * 256 * nthreads);
+  if (tmp_keys == NULL || tmp_order == NULL || hist == NULL) {
+    fprintf(stderr, "Couldn't allocate sort buffer\r\n");
+    exit(-1);
+  }
+
+  // 下の桁から8ビットずつ、安定な計数ソートを4回行う
+  // 各スレッドは連続した範囲を受け持ち、桁ごと・スレッドの順に書き込み位置を決めるので順番が保たれる
+  for (int shift=0; shift<32; shift+=8) {
+#pragma omp parallel num_threads(nthreads)
+    {
+      int tid = 0, team = 1;
+#ifdef _OPENMP
+      tid = omp_get_thread_num();
+      team = omp_get_num_threads();
+#endif
+      const size_t begin = n * tid / team, end = n * (tid + 1) / team;
+      size_t *mine = hist + 256 * tid;
+
+      memset(mine, 0, sizeof(size_t) * 256);
+      for (size_t i=begin; i<end; i++) {
+        mine[(keys[i] >> shift) & 0xFF]++;
+      }
+
+#pragma omp barrier
+#pragma omp single
+      {
+        size_t sum = 0;
+        for (int digit=0; digit<256; digit++) {
+          for (int t=0; t<team; t++) {
+            size_t c = hist[256 * t + digit];
+            hist[256 * t + digit] = sum;
+            sum += c;
+          }
+        }
+      }
+
+      for (size_t i=begin; i<end; i++) {
+        size_t dst = mine[(keys[i] >> shift) & 0xFF]++;
+        tmp_keys[dst] = keys[i];
+        tmp_order[dst] = order[i];
+      }
+    }
+
+    memcpy(keys, tmp_keys, sizeof(uint32_t) * n);
+    memcpy(order, tmp_order, sizeof(uint32_t) * n);
+  }
+
+  free(tmp_keys);
+  free(tmp_order);
+  free(hist);
+}
+
+void morton_sort(Object objs[], const size_t numobj, const Condition cond) {
+
+  if (numobj < 2) return;
+
+  uint32_t *keys = malloc(sizeof(uint32_t) * numobj);
+  uint32_t *order = malloc(sizeof(uint32_t) * numobj);
+  Object *tmp = malloc(sizeof(Object) * numobj);
+  if (keys == NULL || order == NULL || tmp == NULL) {
+    fprintf(stderr, "Couldn't allocate sort buffer\r\n");
+    exit(-1);
+  }
+
+#pragma omp parallel for
+  for (size_t i=0; i<numobj; i++) {
+    keys[i] = morton_code(objs[i].y, objs[i].x, cond);
+    order[i] = i;
+  }
+
+  radix_sort(keys, order, numobj);
+
+  // 並べ替えた順に物体を集めてから書き戻す
+#pragma omp parallel for
+  for (size_t i=0; i<numobj; i++) {
+    tmp[i] = objs[order[i]];
+  }
+  memcpy(objs, tmp, sizeof(Object) * numobj);
+
+  free(keys);
+  free(order);
+  free(tmp);
+}
+
+void update_id_map(const Object objs[], const size_t numobj, int index_of[], const size_t numids) {
+
+#pragma omp parallel for
+  for (size_t id=0; id<numids; id++) {
+    index_of[id] = -1;
+  }
+
+#pragma omp parallel for
+  for (size_t i=0; i<numobj; i++) {
+    index_of[objs[i].id] = i;
+  }
+}
+
+void fusion_objects(Object objs[], size_t *numobj, NeighborList *list, const Condition cond) {
+
+  // 前回作り直したときから閾値+余裕の半分以上動いた物体がなければ、候補のペアはリストに全て含まれている
+  // fused_stepで印を付けてあり、リストを作り直さなかったときは、印のない物体の相手は調べなくてよい
+  const int marked = list->moved2 >= 0;
+  const size_t rebuilds = list->rebuilds;
+  update_neighbor_list(objs, *numobj, list, cond);
+  const int use_marks = marked && list->rebuilds == rebuilds;
+
+  int count = 0; // 融合した回数(3個が1つになった場合は2回とカウントする)
+
+  // 融合で中点に動いて、リストを作り直したときの位置から余裕の半分より離れた物体
+  // (その物体との近いペアはリストに入っているとは限らないので、リストを使わずに調べる)
+  unsigned char *moved_far = NULL;
+  int *far = NULL;
+  size_t nfar = 0;
+
+  for (int i=0; i<*numobj; i++) {
+    // 一度融合すると相手の位置が変わるので、それ以降は全て調べる
+    if (use_marks && count == 0 && !list->candidate[i]) continue;
+
+    // 全てのペアを調べたときと同じく、閾値より近い相手のうち番号の最も小さいものと融合する
+    int j = -1;
+    if (moved_far != NULL && moved_far[i]) {
+      for (int k=i+1; k<*numobj; k++) {
+        if (sqrt(pow(objs[i].y - objs[k].y, 2) + pow(objs[i].x - objs[k].x, 2)) < cond.threshold) {
+          j = k;
+          break;
+        }
+      }
+    } else {
+      for (size_t k=list->offset[i]; k<list->offset[i+1]; k++) {
+        const int n = list->neighbors[k];
+        if (sqrt(pow(objs[i].y - objs[n].y, 2) + pow(objs[i].x - objs[n].x, 2)) < cond.threshold) {
+          j = n;
+          break;
+        }
+      }
+      for (size_t f=0; f<nfar; f++) {
+        const int n = far[f];
+        if (n <= i || (j >= 0 && n >= j)) continue;
+        if (sqrt(pow(objs[i].y - objs[n].y, 2) + pow(objs[i].x - objs[n].x, 2)) < cond.threshold) j = n;
+      }
+    }
+    if (j < 0) continue;
+
+    // 合成後の位置は中点
+    objs[j].y = (objs[i].y + objs[j].y) / 2;
+    objs[j].x = (objs[i].x + objs[j].x) / 2;
+    // 運動量保存から速度を求める
+    objs[j].vy = (objs[i].m * objs[i].vy + objs[j].m * objs[j].vy) / (objs[i].m + objs[j].m);
+    objs[j].vx = (objs[i].m * objs[i].vx + objs[j].m * objs[j].vx) / (objs[i].m + objs[j].m);
+
+    objs[j].m += objs[i].m;
+
+    count++;
+
+    // インデックスの小さい方を後で消滅させるためにm=0としておく(これ以降のiはこれより大きいので参照しない)
+    objs[i].m = 0;
+
+    // 中点に動いたjがリストの余裕を超えたら、このステップの残りではリストを使わずに調べる
+    if (pow(objs[j].y - list->ref_y[j], 2) + pow(objs[j].x - list->ref_x[j], 2) > pow(cond.skin / 2, 2)) {
+      if (moved_far == NULL) {
+        moved_far = calloc(*numobj, 1);
+        far = malloc(sizeof(int) * *numobj);
+        if (moved_far == NULL || far == NULL) {
+          fprintf(stderr, "Couldn't allocate fusion table\r\n");
+          exit(-1);
+        }
+      }
+      if (!moved_far[j]) {
+        moved_far[j] = 1;
+        far[nfar++] = j;
+      }
+    }
+  }
+  free(moved_far);
+  free(far);
+
+  if (count == 0) return;
+
+  // 残ったオブジェクトを順番を保ったまま前に詰める
+  size_t kept = 0;
+  for (size_t i=0; i<*numobj; i++) {
+    if (objs[i].m != 0) objs[kept++] = objs[i];
+  }
+  *numobj = kept;
+
+  // インデックスが変わったのでリストは作り直す
+  list->valid = 0;
+}
+
+void update_neighbor_list(const Object objs[], const size_t numobj, NeighborList *list, const Condition cond) {
+
+  // fused_stepで移動のついでに求めてあれば、それを使う
+  const double known = list->moved2;
+  list->moved2 = -1;
+
+  if (list->valid && list->numobj == numobj) {
+    double max_disp2 = known;
+    if (max_disp2 < 0) {
+      max_disp2 = 0;
+#pragma omp parallel for reduction(max:max_disp2)
+      for (size_t i=0; i<numobj; i++) {
+        double d2 = pow(objs[i].y - list->ref_y[i], 2) + pow(objs[i].x - list->ref_x[i], 2);
+        if (d2 > max_disp2) max_disp2 = d2;
+      }
+    }
+    if (max_disp2 <= pow(cond.skin / 2, 2)) return;
+  }
+
+  build_neighbor_list(objs, numobj, list, cond);
+}
+
+// 空間ハッシュ用。セル座標からバケットの番号を求める
+static size_t cell_hash(const long cy, const long cx, const size_t nbucket) {
+  return ((uint64_t)cy * 73856093u ^ (uint64_t)cx * 19349663u) % nbucket;
+}
+
+void build_neighbor_list(const Object objs[], const size_t numobj, NeighborList *list, const Condition cond) {
+
+  const double range = cond.threshold + cond.skin;
+  const size_t nbucket = 2 * numobj + 1;
+
+  // 作り直すときの位置を覚えておく
+  list->ref_y = realloc(list->ref_y, sizeof(double) * (numobj + 1));
+  list->ref_x = realloc(list->ref_x, sizeof(double) * (numobj + 1));
+  list->offset = realloc(list->offset, sizeof(size_t) * (numobj + 1));
+  list->slack = realloc(list->slack, sizeof(double) * (numobj + 1));
+  list->candidate = realloc(list->candidate, numobj + 1);
+  long *cell_y = malloc(sizeof(long) * (numobj + 1));
+  long *cell_x = malloc(sizeof(long) * (numobj + 1));
+  size_t *bucket_start = calloc(nbucket + 1, sizeof(size_t));
+  int *sorted = malloc(sizeof(int) * (numobj + 1));
+  if (list->ref_y == NULL || list->ref_x == NULL || list->offset == NULL || list->slack == NULL || list->candidate == NULL ||
+      cell_y == NULL || cell_x == NULL || bucket_start == NULL || sorted == NULL) {
+    fprintf(stderr, "Couldn't allocate neighbor list\r\n");
+    exit(-1);
+  }
+
+  // 一辺rangeのセルに分け、セルをハッシュでバケットに振り分ける(画面外に飛んでいった物体があっても大丈夫なように)
+  for (size_t i=0; i<numobj; i++) {
+    list->ref_y[i] = objs[i].y;
+    list->ref_x[i] = objs[i].x;
+    cell_y[i] = floor(objs[i].y / range);
+    cell_x[i] = floor(objs[i].x / range);
+    bucket_start[cell_hash(cell_y[i], cell_x[i], nbucket) + 1]++;
+  }
+  for (size_t b=0; b<nbucket; b++) {
+    bucket_start[b+1] += bucket_start[b];
+  }
+  {
+    size_t *fill = malloc(sizeof(size_t) * nbucket);
+    memcpy(fill, bucket_start, sizeof(size_t) * nbucket);
+    for (size_t i=0; i<numobj; i++) {
+      sorted[fill[cell_hash(cell_y[i], cell_x[i], nbucket)]++] = i;
+    }
+    free(fill);
+  }
+
+  // 1回目で個数を数え、2回目で書き込む
+  // 周囲9セルのうち、jのセルが一致するものだけを見るので同じペアが重複することはない
+  for (int pass = 0; pass < 2; pass++) {
+
+#pragma omp parallel
+    {
+      const uint64_t traced = trace_begin();
+      size_t searched = 0;
+#pragma omp for schedule(dynamic, 1024) nowait
+      for (size_t i=0; i<numobj; i++) {
+        size_t n = 0;
+        searched++;
+        int *out = pass == 1 ? list->neighbors + list->offset[i] : NULL;
+        double nearest2 = INFINITY; // 相手までの距離の2乗の最小
+
+        for (long dy=-1; dy<=1; dy++) {
+          for (long dx=-1; dx<=1; dx++) {
+            size_t b = cell_hash(cell_y[i] + dy, cell_x[i] + dx, nbucket);
+            for (size_t k=bucket_start[b]; k<bucket_start[b+1]; k++) {
+              int j = sorted[k];
+              if (j <= i || cell_y[j] != cell_y[i] + dy || cell_x[j] != cell_x[i] + dx) continue;
+              const double d2 = pow(objs[i].y - objs[j].y, 2) + pow(objs[i].x - objs[j].x, 2);
+              if (d2 >= range * range) continue;
+              if (d2 < nearest2) nearest2 = d2;
+
+              if (out != NULL) {
+                // 融合の判定は元の全ペアの判定と同じくjの小さい順に行うので、挿入ソートで並べておく
+                size_t m = n;
+                while (m > 0 && out[m-1] > j) {
+                  out[m] = out[m-1];
+                  m--;
+                }
+                out[m] = j;
+              }
+              n++;
+            }
+          }
+        }
+
+        if (pass == 0) list->offset[i+1] = n;
+        // 融合できる距離まで近づくのに、この物体がどれだけ動く必要があるか(相手は余裕の半分まで動くとする)
+        // 丸め誤差で境目の判定が変わらないように少しだけ小さめにしておく
+        if (pass == 1) list->slack[i] = sqrt(nearest2) - cond.threshold - cond.skin / 2 - 1e-9 * range;
+      }
+      trace_end(TRACE_NEIGHBORS, traced, searched);
+    }
+
+    if (pass == 0) {
+      list->offset[0] = 0;
+      for (size_t i=0; i<numobj; i++) {
+        list->offset[i+1] += list->offset[i];
+      }
+      list->neighbors = realloc(list->neighbors, sizeof(int) * (list->offset[numobj] + 1));
+      if (list->neighbors == NULL) {
+        fprintf(stderr, "Couldn't allocate neighbor list\r\n");
+        exit(-1);
+      }
+    }
+  }
+
+  list->numobj = numobj;
+  list->valid = 1;
+  list->rebuilds++;
+
+  free(cell_y);
+  free(cell_x);
+  free(bucket_start);
+  free(sorted);
+}
+
+void compact_neighbor_list(NeighborList *list, const int new_index[]) {
+
+  // 前から順に詰めるので、読む位置より後ろに書くことはない
+  size_t kept = 0, w = 0;
+  for (size_t i=0; i<list->numobj; i++) {
+    const size_t begin = list->offset[i], end = list->offset[i+1];
+    if (new_index[i] < 0) continue;
+    list->offset[kept] = w;
+    for (size_t k=begin; k<end; k++) {
+      const int j = new_index[list->neighbors[k]];
+      if (j >= 0) list->neighbors[w++] = j;
+    }
+    list->ref_y[kept] = list->ref_y[i];
+    list->ref_x[kept] = list->ref_x[i];
+    list->slack[kept] = -1; // 融合した物体が近くに来たかもしれないので、作り直すまでは全て融合の候補にする
+    kept++;
+  }
+  list->offset[kept] = w;
+  list->numobj = kept;
+}
+
+void free_neighbor_list(NeighborList *list) {
+  free(list->offset);
+  free(list->neighbors);
+  free(list->ref_y);
+  free(list->ref_x);
+  free(list->slack);
+  free(list->candidate);
+  *list = (NeighborList) {.moved2 = -1};
+}
+
+
+static void sift_up(EventHeap *h, size_t k) {
+  const FusionEvent e = h->events[k];
+  while (k > 0 && h->events[(k - 1) / 2].time > e.time) {
+    h->events[k] = h->events[(k - 1) / 2];
+    k = (k - 1) / 2;
+  }
+  h->events[k] = e;
+}
+
+static void sift_down(EventHeap *h, size_t k) {
+  const FusionEvent e = h->events[k];
+  while (2 * k + 1 < h->size) {
+    size_t c = 2 * k + 1;
+    if (c + 1 < h->size && h->events[c+1].time < h->events[c].time) c++;
+    if (h->events[c].time >= e.time) break;
+    h->events[k] = h->events[c];
+    k = c;
+  }
+  h->events[k] = e;
+}
+
+// 末尾に足すだけで並べ直さない(後でrestore_heapを呼ぶ)
+static void append_event(EventHeap *h, const FusionEvent e) {
+  if (h->size == h->capacity) {
+    h->capacity = h->capacity > 0 ? h->capacity * 2 : 1024;
+    h->events = realloc(h->events, sizeof(FusionEvent) * h->capacity);
+    if (h->events == NULL) {
+      fprintf(stderr, "Couldn't allocate fusion events\r\n");
+      exit(-1);
+    }
+  }
+  h->events[h->size++] = e;
+}
+
+// events[start]以降に足した分をヒープに入れる(たくさん足したときは全体を作り直した方が速い)
+static void restore_heap(EventHeap *h, const size_t start) {
+  if ((h->size - start) * 8 > h->size) {
+    for (size_t k=h->size/2; k-->0; ) {
+      sift_down(h, k);
+    }
+  } else {
+    for (size_t k=start; k<h->size; k++) {
+      sift_up(h, k);
+    }
+  }
+}
+
+static void push_event(EventHeap *h, const FusionEvent e) {
+  append_event(h, e);
+  sift_up(h, h->size - 1);
+}
+
+static FusionEvent pop_event(EventHeap *h) {
+  const FusionEvent top = h->events[0];
+  h->events[0] = h->events[--h->size];
+  if (h->size > 0) sift_down(h, 0);
+  return top;
+}
+
+// このステップで位置を y - vy * (dt - tau) と戻せるように直線に沿って動いたか
+// (fused_stepの移動と同じ式だが、計算の順番で丸めが変わっても大丈夫なように少しだけ許す)
+static int moves_linearly(const Object *o, const Condition cond) {
+  return o->partner < 0 &&
+    fabs(o->prev_y + o->vy * cond.dt - o->y) <= 1e-12 * (fabs(o->y) + 1) &&
+    fabs(o->prev_x + o->vx * cond.dt - o->x) <= 1e-12 * (fabs(o->x) + 1);
+}
+
+// ステップの始まりからtau後の位置(直線に沿って動かなかった物体はステップの終わりの位置)
+static double position_at(const double p, const double v, const int linear, const double tau, const Condition cond) {
+  return linear ? p - v * (cond.dt - tau) : p;
+}
+
+// objs[i]とobjs[j]がこのステップのtau_lo以降で最初に閾値より近づく時刻をdueに入れる
+// どちらかが直線に沿って動かなかったときは、今までと同じくステップの終わりの位置だけで判定する
+static void schedule_crossing(EventQueue *q, const Object objs[], const int i, const int j, const double tau_lo, const Condition cond) {
+
+  q->checked++;
+  const Object *a = &objs[i], *b = &objs[j];
+  const double ry = a->y - b->y, rx = a->x - b->x;
+  const double c = ry * ry + rx * rx - cond.threshold * cond.threshold;
+  double tau = INFINITY;
+
+  if (!q->linear[i] || !q->linear[j]) {
+    if (c < 0) tau = cond.dt;
+  } else {
+    // ステップの終わりからu前の距離の2乗 |r - w u|^2 が閾値の2乗を下回るuの範囲 [u1, u2] を求め、
+    // [0, dt - tau_lo] の中で最も早い時刻(最も大きいu)を選ぶ
+    const double wy = a->vy - b->vy, wx = a->vx - b->vx;
+    const double aa = wy * wy + wx * wx, bb = -(ry * wy + rx * wx);
+    const double umax = cond.dt - tau_lo;
+    if (aa == 0) {
+      if (c < 0) tau = tau_lo;
+    } else {
+      const double disc = bb * bb - aa * c;
+      if (disc >= 0) {
+        const double u1 = (-bb - sqrt(disc)) / aa, u2 = (-bb + sqrt(disc)) / aa;
+        if (u2 >= 0 && u1 <= umax && (c < 0 || u2 > 0)) tau = cond.dt - (u2 < umax ? u2 : umax);
+      }
+    }
+  }
+
+  if (tau <= cond.dt) {
+    push_event(&q->due, (FusionEvent) {.time = tau, .i = i, .j = j, .vi = q->version[i], .vj = q->version[j]});
+  }
+}
+
+// 予測に使う直線をtの今の位置と速度に取り直す
+static void reference_body(EventQueue *q, const Object *o, const int i, const double t) {
+  q->ref_t[i] = t;
+  q->ref_y[i] = o->y;
+  q->ref_x[i] = o->x;
+  q->ref_vy[i] = o->vy;
+  q->ref_vx[i] = o->vx;
+  q->version[i]++;
+}
+
+// 予測の直線同士がt以降で最初に閾値+余裕まで近づく時刻をpendingの末尾に足す(近づかなければ足さない)
+// どちらの物体も直線から余裕の半分より離れていなければ、その時刻より前に閾値を横切ることはない
+static void predict_pair(EventQueue *q, const int i, const int j, const double t, const Condition cond) {
+
+  const double reach = cond.threshold + cond.skin * EVENT_MARGIN;
+  const double ry = q->ref_y[i] + q->ref_vy[i] * (t - q->ref_t[i]) - q->ref_y[j] - q->ref_vy[j] * (t - q->ref_t[j]);
+  const double rx = q->ref_x[i] + q->ref_vx[i] * (t - q->ref_t[i]) - q->ref_x[j] - q->ref_vx[j] * (t - q->ref_t[j]);
+  const double wy = q->ref_vy[i] - q->ref_vy[j], wx = q->ref_vx[i] - q->ref_vx[j];
+  const double c = ry * ry + rx * rx - reach * reach;
+  const double aa = wy * wy + wx * wx, bb = ry * wy + rx * wx;
+
+  double s = INFINITY;
+  if (c <= 0) {
+    s = 0;
+  } else if (bb < 0 && bb * bb - aa * c >= 0) {
+    s = (-bb - sqrt(bb * bb - aa * c)) / aa;
+  }
+  if (s == INFINITY) return;
+
+  q->predicted++;
+  append_event(&q->pending, (FusionEvent) {.time = t + s, .i = i, .j = j, .vi = q->version[i], .vj = q->version[j]});
+}
+
+// 候補のリストから両方向の相手の表を作る
+static void build_adjacency(EventQueue *q, const NeighborList *list, const size_t numobj) {
+
+  q->adj = realloc(q->adj, sizeof(int) * (2 * list->offset[numobj] + 1));
+  if (q->adj == NULL) {
+    fprintf(stderr, "Couldn't allocate fusion events\r\n");
+    exit(-1);
+  }
+
+  // 数えてから詰める
+  memset(q->adj_offset, 0, sizeof(size_t) * (numobj + 2));
+  for (size_t i=0; i<numobj; i++) {
+    for (size_t k=list->offset[i]; k<list->offset[i+1]; k++) {
+      q->adj_offset[i + 2]++;
+      q->adj_offset[list->neighbors[k] + 2]++;
+    }
+  }
+  for (size_t i=0; i<numobj; i++) {
+    q->adj_offset[i + 2] += q->adj_offset[i + 1];
+  }
+  for (size_t i=0; i<numobj; i++) {
+    for (size_t k=list->offset[i]; k<list->offset[i+1]; k++) {
+      const int j = list->neighbors[k];
+      q->adj[q->adj_offset[i + 1]++] = j;
+      q->adj[q->adj_offset[j + 1]++] = i;
+    }
+  }
+}
+
+// 融合の候補のリストを作り直したら、両方向の相手の表を作って全ての物体を予測し直す
+static void reset_events(EventQueue *q, const NeighborList *list, const size_t numobj) {
+
+  q->numobj = numobj;
+  q->rebuilds = list->rebuilds;
+  q->pending.size = 0;
+  q->due.size = 0;
+  q->nagain = 0;
+
+  q->ref_t = realloc(q->ref_t, sizeof(double) * (numobj + 1));
+  q->ref_y = realloc(q->ref_y, sizeof(double) * (numobj + 1));
+  q->ref_x = realloc(q->ref_x, sizeof(double) * (numobj + 1));
+  q->ref_vy = realloc(q->ref_vy, sizeof(double) * (numobj + 1));
+  q->ref_vx = realloc(q->ref_vx, sizeof(double) * (numobj + 1));
+  q->version = realloc(q->version, sizeof(unsigned) * (numobj + 1));
+  q->linear = realloc(q->linear, numobj + 1);
+  q->recheck = realloc(q->recheck, numobj + 1);
+  q->adj_offset = realloc(q->adj_offset, sizeof(size_t) * (numobj + 2));
+  if (q->ref_t == NULL || q->ref_y == NULL || q->ref_x == NULL || q->ref_vy == NULL || q->ref_vx == NULL ||
+      q->version == NULL || q->linear == NULL || q->recheck == NULL || q->adj_offset == NULL) {
+    fprintf(stderr, "Couldn't allocate fusion events\r\n");
+    exit(-1);
+  }
+
+  build_adjacency(q, list, numobj);
+
+  for (size_t i=0; i<numobj; i++) {
+    q->version[i] = 0;
+    q->recheck[i] = 1;
+  }
+}
+
+// 融合で物体を詰めたときに、物体ごとの値と予測の番号をnew_index[](消えた物体は-1)に付け替える
+static void compact_events(EventQueue *q, const NeighborList *list, const int new_index[], const size_t kept) {
+
+  for (size_t i=0; i<q->numobj; i++) {
+    const int k = new_index[i];
+    if (k < 0) continue;
+    q->ref_t[k] = q->ref_t[i];
+    q->ref_y[k] = q->ref_y[i];
+    q->ref_x[k] = q->ref_x[i];
+    q->ref_vy[k] = q->ref_vy[i];
+    q->ref_vx[k] = q->ref_vx[i];
+    q->version[k] = q->version[i];
+    q->linear[k] = q->linear[i];
+    q->recheck[k] = q->recheck[i];
+  }
+
+  // 消えた物体の予測を捨てて番号を付け替え、ヒープを作り直す
+  size_t w = 0;
+  for (size_t k=0; k<q->pending.size; k++) {
+    FusionEvent e = q->pending.events[k];
+    if (new_index[e.i] < 0 || new_index[e.j] < 0) continue;
+    e.i = new_index[e.i];
+    e.j = new_index[e.j];
+    q->pending.events[w++] = e;
+  }
+  q->pending.size = w;
+  restore_heap(&q->pending, 0);
+
+  w = 0;
+  for (size_t k=0; k<q->nagain; k+=2) {
+    if (new_index[q->again[k]] < 0 || new_index[q->again[k+1]] < 0) continue;
+    q->again[w++] = new_index[q->again[k]];
+    q->again[w++] = new_index[q->again[k+1]];
+  }
+  q->nagain = w;
+
+  q->numobj = kept;
+  build_adjacency(q, list, kept);
+}
+
+// 融合しなかったペアを後で予測し直すために覚えておく
+static void remember_pair(EventQueue *q, const int i, const int j) {
+  if (q->nagain + 2 > q->again_capacity) {
+    q->again_capacity = q->again_capacity > 0 ? q->again_capacity * 2 : 1024;
+    q->again = realloc(q->again, sizeof(int) * q->again_capacity);
+    if (q->again == NULL) {
+      fprintf(stderr, "Couldn't allocate fusion events\r\n");
+      exit(-1);
+    }
+  }
+  q->again[q->nagain++] = i;
+  q->again[q->nagain++] = j;
+}
+
+void fusion_events(Object objs[], size_t *numobj, NeighborList *list, EventQueue *q, const Condition cond) {
+
+  const size_t n = *numobj;
+  const double step_end = q->now + cond.dt;
+  const double drift = cond.skin * EVENT_MARGIN / 2; // 予測の直線から離れてよい距離
+
+  // リストを作り直したとき(融合や並べ替えで並びが変わったときも)は全てのペアをこのステップで調べる
+  update_neighbor_list(objs, n, list, cond);
+  const int reset = q->rebuilds != list->rebuilds || q->numobj != n || q->ref_t == NULL;
+  if (reset) reset_events(q, list, n);
+
+  // 直線に沿って動かなかった物体と、予測の直線から離れた物体は、このステップの中で全ての相手を調べて予測し直す
+  // (1ステップの中では実際の位置も予測の直線も直線なので、その差はステップの始まりか終わりで最大になる)
+#pragma omp parallel for
+  for (size_t i=0; i<n; i++) {
+    q->linear[i] = moves_linearly(&objs[i], cond);
+    if (reset) continue;
+    const double dy = objs[i].y - q->ref_y[i] - q->ref_vy[i] * (step_end - q->ref_t[i]);
+    const double dx = objs[i].x - q->ref_x[i] - q->ref_vx[i] * (step_end - q->ref_t[i]);
+    q->recheck[i] = !q->linear[i] || dy * dy + dx * dx > drift * drift;
+  }
+
+  // 予測した時刻がこのステップの終わりまでに来たペアは、実際の動きで閾値を横切る時刻を求める
+  q->nagain = 0;
+  while (q->pending.size > 0 && q->pending.events[0].time <= step_end) {
+    const FusionEvent e = pop_event(&q->pending);
+    if (q->version[e.i] != e.vi || q->version[e.j] != e.vj) {
+      q->stale++;
+      continue;
+    }
+    if (q->recheck[e.i] || q->recheck[e.j]) continue; // 下で全ての相手と一緒に調べる
+    schedule_crossing(q, objs, e.i, e.j, 0, cond);
+    remember_pair(q, e.i, e.j);
+  }
+  for (size_t i=0; i<n; i++) {
+    if (!q->recheck[i]) continue;
+    for (size_t k=q->adj_offset[i]; k<q->adj_offset[i+1]; k++) {
+      const int j = q->adj[k];
+      if (q->recheck[j] && j < (int)i) continue; // 同じペアを2回調べない
+      schedule_crossing(q, objs, i, j, 0, cond);
+    }
+  }
+
+  // 横切る時刻の早い順に融合する(インデックスの小さい方を消し、大きい方に合成する)
+  int count = 0;
+  int moved_far = 0; // 合成した位置が候補のリストを作り直したときから余裕の半分以上離れたら1
+  while (q->due.size > 0) {
+    const FusionEvent e = pop_event(&q->due);
+    if (objs[e.i].m == 0 || objs[e.j].m == 0 || q->version[e.i] != e.vi || q->version[e.j] != e.vj) continue;
+
+    const int lo = e.i < e.j ? e.i : e.j, hi = e.i < e.j ? e.j : e.i;
+    Object *o1 = &objs[lo], *o2 = &objs[hi];
+    const double tau = e.time;
+    // 合成後の位置は横切った時刻の中点
+    const double y = (position_at(o1->y, o1->vy, q->linear[lo], tau, cond) + position_at(o2->y, o2->vy, q->linear[hi], tau, cond)) / 2;
+    const double x = (position_at(o1->x, o1->vx, q->linear[lo], tau, cond) + position_at(o2->x, o2->vx, q->linear[hi], tau, cond)) / 2;
+    // 運動量保存から速度を求め、残りの時間はその速度で進める
+    o2->vy = (o1->m * o1->vy + o2->m * o2->vy) / (o1->m + o2->m);
+    o2->vx = (o1->m * o1->vx + o2->m * o2->vx) / (o1->m + o2->m);
+    o2->y = y + o2->vy * (cond.dt - tau);
+    o2->x = x + o2->vx * (cond.dt - tau);
+    o2->prev_y = o2->y - o2->vy * cond.dt;
+    o2->prev_x = o2->x - o2->vx * cond.dt;
+    o2->m += o1->m;
+    o2->partner = -1;
+    o1->m = 0;
+    count++;
+    if (pow(o2->y - list->ref_y[hi], 2) + pow(o2->x - list->ref_x[hi], 2) > pow(cond.skin / 2, 2)) moved_far = 1;
+
+    // 合成した物体は、両方の相手とtau以降に横切るかを調べ直す
+    q->linear[hi] = 1;
+    q->recheck[hi] = 1;
+    q->version[hi]++;
+    for (int side=0; side<2; side++) {
+      const int b = side == 0 ? hi : lo;
+      for (size_t k=q->adj_offset[b]; k<q->adj_offset[b+1]; k++) {
+        const int j = q->adj[k];
+        if (j != lo && j != hi && objs[j].m != 0) schedule_crossing(q, objs, hi, j, tau, cond);
+      }
+    }
+  }
+  q->fused += count;
+  q->now = step_end;
+
+  size_t m = n;
+  if (count > 0) {
+    // 残ったオブジェクトを順番を保ったまま前に詰め、候補のリストと予測の番号を詰めた後の番号に付け替える
+    // (作り直すと全てのペアを予測し直すことになるので、融合した物体だけを予測し直す)
+    int *new_index = malloc(sizeof(int) * (n + 1));
+    if (new_index == NULL) {
+      fprintf(stderr, "Couldn't allocate fusion events\r\n");
+      exit(-1);
+    }
+    size_t kept = 0;
+    for (size_t i=0; i<n; i++) {
+      new_index[i] = objs[i].m != 0 ? (int)kept : -1;
+      if (objs[i].m != 0) objs[kept++] = objs[i];
+    }
+    compact_neighbor_list(list, new_index);
+    compact_events(q, list, new_index, kept);
+    free(new_index);
+    *numobj = m = kept;
+    // リストに入っていない相手に近づいたかもしれないので、次のステップで作り直して全て予測し直す
+    if (moved_far) list->valid = 0;
+  }
+
+  // 調べ直した物体は今の位置と速度から、時刻が来たペアは同じ直線のまま次の時刻を予測する
+  const size_t start = q->pending.size;
+  for (size_t i=0; i<m; i++) {
+    if (q->recheck[i]) reference_body(q, &objs[i], i, step_end);
+  }
+  for (size_t i=0; i<m; i++) {
+    if (!q->recheck[i]) continue;
+    for (size_t k=q->adj_offset[i]; k<q->adj_offset[i+1]; k++) {
+      const int j = q->adj[k];
+      if (q->recheck[j] && j < (int)i) continue;
+      predict_pair(q, i, j, step_end, cond);
+    }
+  }
+  for (size_t k=0; k<q->nagain; k+=2) {
+    predict_pair(q, q->again[k], q->again[k+1], step_end, cond);
+  }
+  restore_heap(&q->pending, start);
+}
+
+void free_event_queue(EventQueue *q) {
+  free(q->pending.events);
+  free(q->due.events);
+  free(q->ref_t);
+  free(q->ref_y);
+  free(q->ref_x);
+  free(q->ref_vy);
+  free(q->ref_vx);
+  free(q->version);
+  free(q->linear);
+  free(q->recheck);
+  free(q->adj_offset);
+  free(q->adj);
+  free(q->again);
+  memset(q, 0, sizeof(EventQueue));
+}
+
+// /sys/devices/system/node/online("0-1,3"のような形式)のノードに印をつけ、最大のノード番号+1を返す
+static int online_nodes(unsigned long *mask) {
+
+  *mask = 0;
+  int maxnode = 0;
+  char buf[256];
+  FILE *fp = fopen("/sys/devices/system/node/online", "r");
+  if (fp == NULL || fgets(buf, sizeof(buf), fp) == NULL) {
+    if (fp != NULL) fclose(fp);
+    *mask = 1; // NUMAでなければノード0だけ
+    return 1;
+  }
+  fclose(fp);
+
+  char *p = buf;
+  while (*p >= '0' && *p <= '9') {
+    long first = strtol(p, &p, 10), last = first;
+    if (*p == '-') last = strtol(p + 1, &p, 10);
+    for (long n=first; n<=last && n<MAX_NUMA_NODES; n++) {
+      *mask |= 1UL << n;
+      if (n + 1 > maxnode) maxnode = n + 1;
+    }
+    if (*p == ',') p++;
+  }
+  return maxnode;
+}
+
+void *alloc_bodies(BodyMemory *mem, const size_t count, const size_t elem, const MemoryPolicy policy) {
+
+  const size_t bytes = count * elem;
+  mem->pages = policy.pages;
+  mem->placement = policy.placement;
+
+  if (policy.pages == PAGES_DEFAULT && policy.placement == PLACE_FIRST_TOUCH) {
+    mem->mapped = 0;
+    mem->size = bytes;
+    mem->ptr = malloc(bytes);
+    return mem->ptr;
+  }
+
+  // ページの大きさの倍数でmmapする
+  mem->mapped = 1;
+  const size_t page = policy.pages == PAGES_DEFAULT ? (size_t)sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+  mem->size = (bytes + page - 1) / page * page;
+  if (mem->size == 0) mem->size = page;
+
+  char *base = MAP_FAILED;
+  if (policy.pages == PAGES_HUGETLB) {
+    base = mmap(NULL, mem->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) {
+      fprintf(stderr, "Couldn't map %zu bytes of huge pages (see /proc/sys/vm/nr_hugepages), using transparent huge pages\r\n", mem->size);
+      mem->pages = PAGES_THP;
+    }
+  }
+
+  if (base == MAP_FAILED) {
+    // THPはhuge pageの境界から並んだ部分にしか使われないので、余分に確保して境界から切り出す
+    const size_t extra = mem->pages == PAGES_THP ? HUGE_PAGE_SIZE : 0;
+    char *raw = mmap(NULL, mem->size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+      mem->ptr = NULL;
+      return NULL;
+    }
+    base = raw;
+    if (extra > 0) {
+      base = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+      if (base > raw) munmap(raw, base - raw);
+      if (raw + extra > base) munmap(base + mem->size, raw + extra - base);
+      madvise(base, mem->size, MADV_HUGEPAGE);
+    }
+  }
+
+  if (policy.placement == PLACE_INTERLEAVE) {
+    // まだ割り当てられていないページを全ノードに順番に置くようにする
+    unsigned long mask;
+    online_nodes(&mask);
+    if (syscall(SYS_mbind, base, mem->size, MPOL_INTERLEAVE, &mask, 8 * sizeof(mask) + 1, 0) != 0) {
+      fprintf(stderr, "Couldn't interleave pages over NUMA nodes\r\n");
+    }
+  }
+
+  // ページを割り当てておく。PLACE_PARTITIONではfused_stepの移動のループ(schedule(static))とほぼ同じ範囲を各スレッドが書く
+  // (-aの力の計算(update_velocities_plan)はスレッド数やiの分け方が違うので、その範囲とは合うとは限らない)
+  size_t touched = 0;
+  if (policy.placement == PLACE_PARTITION) {
+#pragma omp parallel for schedule(static)
+    for (size_t i=0; i<count; i++) {
+      memset(base + i * elem, 0, elem);
+    }
+    touched = bytes;
+  }
+  memset(base + touched, 0, mem->size - touched);
+
+  mem->ptr = base;
+  return base;
+}
+
+void free_bodies(BodyMemory *mem) {
+  if (mem->mapped) {
+    munmap(mem->ptr, mem->size);
+  } else {
+    free(mem->ptr);
+  }
+  mem->ptr = NULL;
+}
+
+void report_bodies(const BodyMemory *mem, const char *name) {
+
+  static const char *page_names[] = {"default", "THP", "hugetlb"};
+  static const char *placement_names[] = {"first-touch", "interleave", "partition"};
+  const uintptr_t begin = (uintptr_t)mem->ptr, end = begin + mem->size;
+
+  // smapsから領域に重なる対応付けのページの大きさとTHPになっている量を読む
+  size_t page_kb = 0, thp_kb = 0;
+  FILE *fp = fopen("/proc/self/smaps", "r");
+  if (fp != NULL) {
+    char line[512];
+    int inside = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      unsigned long lo, hi;
+      size_t kb;
+      if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+        inside = lo < end && hi > begin;
+      } else if (inside && sscanf(line, "KernelPageSize: %zu kB", &kb) == 1) {
+        if (kb > page_kb) page_kb = kb;
+      } else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+        thp_kb += kb;
+      }
+    }
+    fclose(fp);
+  }
+
+  // 等間隔に選んだページがどのノードにあるかをmove_pagesで調べる(移動はしない)
+  static void *pages[PLACEMENT_SAMPLES];
+  static int status[PLACEMENT_SAMPLES];
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t npages = (mem->size + page - 1) / page;
+  const size_t stride = (npages + PLACEMENT_SAMPLES - 1) / PLACEMENT_SAMPLES;
+  size_t n = 0;
+  for (size_t k=0; k<npages; k+=stride) {
+    pages[n++] = (char *)mem->ptr + k * page;
+  }
+
+  printf("%s: %.1lf MiB, %s pages (page size %zu KiB, THP %.1lf MiB), %s",
+    name, mem->size / 1048576.0, page_names[mem->pages], page_kb, thp_kb / 1024.0, placement_names[mem->placement]);
+#ifdef _OPENMP
+  if (mem->placement == PLACE_PARTITION) printf(" over %d threads", omp_get_max_threads());
+#endif
+
+  if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) != 0) {
+    printf(", node placement unknown\r\n");
+    return;
+  }
+  size_t on_node[MAX_NUMA_NODES] = {0}, missing = 0;
+  for (size_t k=0; k<n; k++) {
+    if (status[k] >= 0 && status[k] < MAX_NUMA_NODES) {
+      on_node[status[k]]++;
+    } else {
+      missing++; // まだ割り当てられていないページなど
+    }
+  }
+  printf(", nodes:");
+  for (int d=0; d<MAX_NUMA_NODES; d++) {
+    if (on_node[d] > 0) printf(" node%d %.1lf%%", d, 100.0 * on_node[d] / n);
+  }
+  if (missing > 0) printf(" not present %.1lf%%", 100.0 * missing / n);
+  printf("\r\n");
+}
+
+DomainShared *create_domains(const size_t capacity, const int nproc) {
+
+  char name[64];
+  snprintf(name, sizeof(name), "/my_bouncing3.%d", (int)getpid());
+
+  size_t size = sizeof(DomainShared) + sizeof(Object) * capacity;
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    fprintf(stderr, "Couldn't create shared memory '%s'\r\n", name);
+    exit(-1);
+  }
+
+  DomainShared *sh = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  // 子プロセスはforkで対応付けを引き継ぐので、名前はすぐに消しておく(異常終了しても残らないように)
+  shm_unlink(name);
+  if (sh == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map shared memory '%s'\r\n", name);
+    exit(-1);
+  }
+
+  sh->nproc = nproc;
+  sh->size = size;
+  sh->numobj = 0;
+  sh->stop = 0;
+  for (int d=0; d<nproc; d++) {
+    sh->start[d] = sh->count[d] = 0;
+  }
+
+  // 別のプロセスからも待ち合わせできるバリア
+  pthread_barrierattr_t attr;
+  pthread_barrierattr_init(&attr);
+  pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_barrier_init(&sh->barrier, &attr, nproc);
+  pthread_barrierattr_destroy(&attr);
+
+  return sh;
+}
+
+int fork_domains(DomainShared *sh) {
+
+  // 書きかけの出力が子プロセスにも複製されないように、先に書き出しておく
+  fflush(stdout);
+  const pid_t parent = getpid();
+
+  for (int rank=1; rank<sh->nproc; rank++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "Couldn't fork domain %d\r\n", rank);
+      exit(-1);
+    }
+    if (pid == 0) {
+      // 最初のプロセスがどこで終了しても(確保の失敗などでも)、バリアで待ったまま残らずに一緒に終了する
+      // (prctlより前に終了していたら、親はもう変わっている)
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() != parent) _exit(EXIT_FAILURE);
+      return rank;
+    }
+    sh->pid[rank] = pid;
+  }
+
+  return 0;
+}
+
+int domain_step(DomainShared *sh, const int rank, const Condition cond) {
+
+  // 最初のプロセスが融合と並べ替えを終えるまで待つ
+  pthread_barrier_wait(&sh->barrier);
+  if (sh->stop) return 0;
+
+  Object *objs = sh->objs;
+  const size_t begin = sh->start[rank], count = sh->count[rank];
+
+  // 自分の領域の物体の速度を、全物体の位置から求める(この間は誰も位置を書き換えない)
+  find_encounters(objs + begin, count, cond);
+  my_update_velocities_range(objs, sh->numobj, begin, begin + count, cond);
+  pthread_barrier_wait(&sh->barrier);
+
+  // 全員が速度を求め終えてから位置を動かす
+  my_update_positions(objs + begin, count, cond);
+  my_bounce(objs + begin, count, cond);
+  pthread_barrier_wait(&sh->barrier);
+
+  return 1;
+}
+
+int domain_of(const double x, const int nproc, const Condition cond) {
+  int d = floor((x + cond.width / 2) * nproc / cond.width);
+  return d < 0 ? 0 : d >= nproc ? nproc - 1 : d;
+}
+
+int migrate_domains(DomainShared *sh, const Condition cond) {
+
+  const size_t numobj = sh->numobj;
+  const int nproc = sh->nproc;
+  Object *objs = sh->objs;
+
+  int *dom = malloc(sizeof(int) * (numobj + 1));
+  if (dom == NULL) {
+    fprintf(stderr, "Couldn't allocate domain table\r\n");
+    exit(-1);
+  }
+
+  size_t count[MAX_DOMAINS] = {0};
+  int sorted = 1; // 既に領域の順に並んでいれば並べ替えない
+  for (size_t i=0; i<numobj; i++) {
+    dom[i] = domain_of(objs[i].x, nproc, cond);
+    count[dom[i]]++;
+    if (i > 0 && dom[i] < dom[i-1]) sorted = 0;
+  }
+
+  size_t start = 0;
+  for (int d=0; d<nproc; d++) {
+    sh->start[d] = start;
+    sh->count[d] = count[d];
+    start += count[d];
+  }
+
+  if (!sorted) {
+    // 領域ごとに順番を保ったまま並べ替える(計数ソート)
+    Object *tmp = malloc(sizeof(Object) * numobj);
+    size_t fill[MAX_DOMAINS];
+    if (tmp == NULL) {
+      fprintf(stderr, "Couldn't allocate migration buffer\r\n");
+      exit(-1);
+    }
+    memcpy(fill, sh->start, sizeof(size_t) * nproc);
+    for (size_t i=0; i<numobj; i++) {
+      tmp[fill[dom[i]]++] = objs[i];
+    }
+    memcpy(objs, tmp, sizeof(Object) * numobj);
+    free(tmp);
+  }
+
+  free(dom);
+  return !sorted;
+}
+
+void destroy_domains(DomainShared *sh) {
+
+  // 子プロセスを終了させる
+  sh->stop = 1;
+  pthread_barrier_wait(&sh->barrier);
+  for (int rank=1; rank<sh->nproc; rank++) {
+    waitpid(sh->pid[rank], NULL, 0);
+  }
+
+  pthread_barrier_destroy(&sh->barrier);
+  munmap(sh, sh->size);
+}
+
+static const char *phase_names[NUM_PHASES] = {"force", "drift+bounce", "fusion", "sort", "render"};
+
+void init_ensemble(Ensemble *ens, const Object objs[], const size_t numbody, const size_t numsys, const Condition cond) {
+
+  const size_t size = sizeof(double) * numbody * numsys;
+  ens->numsys = numsys;
+  ens->numbody = numbody;
+  ens->steps = 0;
+  double **arrays[] = {&ens->m, &ens->y, &ens->x, &ens->prev_y, &ens->prev_x, &ens->vy, &ens->vx};
+  for (size_t a=0; a<sizeof(arrays)/sizeof(arrays[0]); a++) {
+    // レーンの並びがベクトルレジスタの境界から始まるように揃える
+    *arrays[a] = aligned_alloc(64, (size + 63) / 64 * 64);
+    if (*arrays[a] == NULL) {
+      fprintf(stderr, "Couldn't allocate ensemble\r\n");
+      exit(-1);
+    }
+  }
+  ens->active = malloc(numsys);
+  ens->finished_at = malloc(sizeof(double) * numsys);
+  if (ens->active == NULL || ens->finished_at == NULL) {
+    fprintf(stderr, "Couldn't allocate ensemble\r\n");
+    exit(-1);
+  }
+
+  // 0番目の系は読み込んだ値そのまま、それ以外は位置と速度を少しずつずらす
+  // (ずらす量は系と物体の番号から決まる乱数なので、スレッド数によらず同じになる)
+#pragma omp parallel for
+  for (size_t s=0; s<numsys; s++) {
+    ens->active[s] = 1;
+    ens->finished_at[s] = INFINITY;
+    for (size_t i=0; i<numbody; i++) {
+      const size_t k = i * numsys + s;
+      const uint64_t index = (uint64_t)s * numbody + i;
+      const double jitter = s == 0 ? 0 : ENSEMBLE_JITTER;
+      ens->m[k] = objs[i].m;
+      ens->y[k] = ens->prev_y[k] = objs[i].y + jitter * (2 * random_uniform(cond.seed, index, 0) - 1);
+      ens->x[k] = ens->prev_x[k] = objs[i].x + jitter * (2 * random_uniform(cond.seed, index, 1) - 1);
+      ens->vy[k] = objs[i].vy + jitter * (2 * random_uniform(cond.seed, index, 2) - 1);
+      ens->vx[k] = objs[i].vx + jitter * (2 * random_uniform(cond.seed, index, 3) - 1);
+    }
+  }
+}
+
+void free_ensemble(Ensemble *ens) {
+  free(ens->m);
+  free(ens->y);
+  free(ens->x);
+  free(ens->prev_y);
+  free(ens->prev_x);
+  free(ens->vy);
+  free(ens->vx);
+  free(ens->active);
+  free(ens->finished_at);
+  *ens = (Ensemble) {0};
+}
+
+static void ensemble_fusion_block(Ensemble *ens, const size_t begin, const size_t end, const double t, const Condition cond);
+
+// 系begin〜end-1をまとめて1ステップ進める
+// 物体の組ごとのループの内側を系(レーン)のループにするので、分岐は全てレーンごとの選択になる
+static void ensemble_block(Ensemble *ens, const size_t begin, const size_t end, const double t, const Condition cond) {
+
+  const size_t K = ens->numsys, n = ens->numbody;
+  double *restrict m = ens->m, *restrict y = ens->y, *restrict x = ens->x;
+  double *restrict prev_y = ens->prev_y, *restrict prev_x = ens->prev_x;
+  double *restrict vy = ens->vy, *restrict vx = ens->vx;
+  const unsigned char *restrict active = ens->active;
+  const double G = cond.G, dt = cond.dt, cor = cond.cor;
+  const double bottom = cond.height / 2, top = -cond.height / 2;
+  const double right = cond.width / 2, left = -cond.width / 2;
+
+  // 速度を更新(消えた物体と終わった系は力を受けず、消えた物体は力を及ぼさない)
+  for (size_t i=0; i<n; i++) {
+    for (size_t j=0; j<n; j++) {
+      if (i == j) continue;
+#pragma omp simd
+      for (size_t s=begin; s<end; s++) {
+        const size_t a = i * K + s, b = j * K + s;
+        const double dy = y[b] - y[a], dx = x[b] - x[a];
+        const int on = active[s] & (m[a] > 0) & (m[b] > 0);
+        const double d2 = on ? dy * dy + dx * dx : 1;
+        const double f = on ? G * m[b] / (d2 * sqrt(d2)) * dt : 0;
+        vy[a] += f * dy;
+        vx[a] += f * dx;
+      }
+    }
+  }
+
+  // 位置を更新し、画面端を横切ったら折り返す(my_bounceと同じ順番で4つの壁を調べる)
+  for (size_t i=0; i<n; i++) {
+#pragma omp simd
+    for (size_t s=begin; s<end; s++) {
+      const size_t a = i * K + s;
+      const double py = y[a], px = x[a];
+      double ny = py + vy[a] * dt, nx = px + vx[a] * dt;
+      double nvy = vy[a], nvx = vx[a];
+
+      // 画面内外が入れ替わったときだけ折り返す
+      const int was_in = (top <= py) & (py <= bottom) & (left <= px) & (px <= right);
+      const int is_in = (top <= ny) & (ny <= bottom) & (left <= nx) & (nx <= right);
+      const int on = active[s] & (m[a] > 0);
+      const int crossed = on & (was_in ^ is_in);
+      ny = on ? ny : py;
+      nx = on ? nx : px;
+
+      int hit = crossed & (((py <= bottom) & (bottom <= ny)) | ((ny <= bottom) & (bottom <= py)));
+      ny = hit ? bottom - (ny - bottom) * cor : ny;
+      nvy = hit ? nvy * -cor : nvy;
+      hit = crossed & (((py <= top) & (top <= ny)) | ((ny <= top) & (top <= py)));
+      ny = hit ? top + (top - ny) * cor : ny;
+      nvy = hit ? nvy * -cor : nvy;
+      hit = crossed & (((px <= right) & (right <= nx)) | ((nx <= right) & (right <= px)));
+      nx = hit ? right - (nx - right) * cor : nx;
+      nvx = hit ? nvx * -cor : nvx;
+      hit = crossed & (((px <= left) & (left <= nx)) | ((nx <= left) & (left <= px)));
+      nx = hit ? left + (left - nx) * cor : nx;
+      nvx = hit ? nvx * -cor : nvx;
+
+      prev_y[a] = py;
+      prev_x[a] = px;
+      y[a] = ny;
+      x[a] = nx;
+      vy[a] = nvy;
+      vx[a] = nvx;
+    }
+  }
+
+  ensemble_fusion_block(ens, begin, end, t, cond);
+}
+
+// 系begin〜end-1の融合。物体が1つになった系はこれ以降進めない
+static void ensemble_fusion_block(Ensemble *ens, const size_t begin, const size_t end, const double t, const Condition cond) {
+
+  const size_t K = ens->numsys, n = ens->numbody;
+  double *restrict m = ens->m, *restrict y = ens->y, *restrict x = ens->x;
+  double *restrict vy = ens->vy, *restrict vx = ens->vx;
+  const unsigned char *restrict active = ens->active;
+  const double threshold2 = cond.threshold * cond.threshold;
+
+  // fusion_objectsと同じく、iごとに番号の小さいjから調べて最初に近かった相手にiを合成する
+  // iを合成したらm=0になるので、それ以降のjとは合成されない
+  for (size_t i=0; i<n; i++) {
+    for (size_t j=i+1; j<n; j++) {
+#pragma omp simd
+      for (size_t s=begin; s<end; s++) {
+        const size_t a = i * K + s, b = j * K + s;
+        const double dy = y[b] - y[a], dx = x[b] - x[a];
+        const int fuse = active[s] & (m[a] > 0) & (m[b] > 0) & (dy * dy + dx * dx < threshold2);
+        const double mass = m[a] + m[b];
+        y[b] = fuse ? (y[a] + y[b]) / 2 : y[b];
+        x[b] = fuse ? (x[a] + x[b]) / 2 : x[b];
+        vy[b] = fuse ? (m[a] * vy[a] + m[b] * vy[b]) / mass : vy[b];
+        vx[b] = fuse ? (m[a] * vx[a] + m[b] * vx[b]) / mass : vx[b];
+        m[b] = fuse ? mass : m[b];
+        m[a] = fuse ? 0 : m[a];
+      }
+    }
+  }
+
+  for (size_t s=begin; s<end; s++) {
+    size_t remaining = 0;
+    for (size_t i=0; i<n; i++) {
+      remaining += m[i * K + s] > 0;
+    }
+    if (ens->active[s] && remaining <= 1) {
+      ens->active[s] = 0;
+      ens->finished_at[s] = t;
+    }
+  }
+}
+
+void fuse_ensemble(Ensemble *ens, const Condition cond) {
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t begin=0; begin<ens->numsys; begin+=ENSEMBLE_BLOCK) {
+    const size_t end = ens->numsys - begin < ENSEMBLE_BLOCK ? ens->numsys : begin + ENSEMBLE_BLOCK;
+    ensemble_fusion_block(ens, begin, end, 0, cond);
+  }
+}
+
+size_t ensemble_step(Ensemble *ens, const double t, const Condition cond) {
+
+  size_t running = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+:running)
+  for (size_t begin=0; begin<ens->numsys; begin+=ENSEMBLE_BLOCK) {
+    const size_t end = ens->numsys - begin < ENSEMBLE_BLOCK ? ens->numsys : begin + ENSEMBLE_BLOCK;
+    ensemble_block(ens, begin, end, t, cond);
+    for (size_t s=begin; s<end; s++) {
+      running += ens->active[s];
+    }
+  }
+  ens->steps++;
+
+  return running;
+}
+
+void run_ensemble(const Object objs[], const size_t numbody, const size_t numsys, const double stop_time, const Condition cond) {
+
+  Ensemble ens;
+  init_ensemble(&ens, objs, numbody, numsys, cond);
+
+  // 初期位置で融合可能な場合は融合する
+  fuse_ensemble(&ens, cond);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  size_t running = numsys;
+  double t = 0;
+  for (int i = 0 ; t <= stop_time && running > 0 ; i++){
+    t = i * cond.dt;
+    running = ensemble_step(&ens, t, cond);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+  // 残った物体数ごとの系の数と、1つになるまでの時間の平均
+  size_t histogram[ENSEMBLE_MAX_BODIES + 1] = {0};
+  double sum_finished = 0;
+  size_t finished = 0;
+  for (size_t s=0; s<numsys; s++) {
+    size_t remaining = 0;
+    for (size_t i=0; i<numbody; i++) {
+      remaining += ens.m[i * numsys + s] > 0;
+    }
+    histogram[remaining]++;
+    if (!ens.active[s]) {
+      sum_finished += ens.finished_at[s];
+      finished++;
+    }
+  }
+
+  printf("ensemble: %zu systems x %zu bodies, %zu steps in %.3lf s (%.2lf ns per body-step)\r\n",
+         numsys, numbody, ens.steps, seconds, seconds * 1e9 / ((double)ens.steps * numsys * numbody));
+  printf("merged into one body: %zu systems", finished);
+  if (finished > 0) printf(" (mean t = %.1lf)", sum_finished / finished);
+  printf("\r\n");
+  printf("remaining bodies:");
+  for (size_t k=1; k<=numbody; k++) {
+    printf(" %zu:%zu", k, histogram[k]);
+  }
+  printf("\r\n");
+  printf("system 0:");
+  for (size_t i=0; i<numbody; i++) {
+    if (ens.m[i * numsys] > 0) printf(" (%.2lf, %.2lf)", ens.y[i * numsys], ens.x[i * numsys]);
+  }
+  printf("\r\n");
+
+  free_ensemble(&ens);
+}
+
+void perf_open(PerfCounters *pc) {
+
+  // 数えるイベント。サイクル数をグループの先頭にして、まとめて読み出す
+  const struct { uint32_t type; uint64_t config; } events[NUM_COUNTERS] = {
+    [COUNTER_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [COUNTER_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [COUNTER_L1D_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [COUNTER_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [COUNTER_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  };
+
+  pc->enabled = 1;
+  pc->nopen = 0;
+  int leader = -1;
+
+  for (int c=0; c<NUM_COUNTERS; c++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[c].type;
+    attr.config = events[c].config;
+    attr.exclude_kernel = 1; // perf_event_paranoid=2でも使えるようにユーザ空間だけ数える
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = (leader < 0);
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    pc->slot[c] = -1;
+    if (fd < 0) {
+      // 先頭が開けなければ全て諦める。それ以外は対応していないイベントだけ飛ばす
+      if (leader < 0) {
+        fprintf(stderr, "perf_event_open failed; reporting wall-clock time only\r\n");
+        return;
+      }
+      continue;
+    }
+    if (leader < 0) leader = fd;
+    pc->fd[pc->nopen] = fd;
+    pc->slot[c] = pc->nopen++;
+  }
+
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// グループの全カウンタを読む
+static void perf_read(const PerfCounters *pc, uint64_t values[NUM_COUNTERS]) {
+  uint64_t buf[1 + NUM_COUNTERS];
+  if (pc->nopen == 0 || read(pc->fd[0], buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) return;
+  for (int c=0; c<NUM_COUNTERS; c++) {
+    values[c] = pc->slot[c] >= 0 ? buf[1 + pc->slot[c]] : 0;
+  }
+}
+
+void perf_begin(PerfCounters *pc) {
+  pc->trace_start = trace_begin();
+  if (!pc->enabled) return;
+  clock_gettime(CLOCK_MONOTONIC, &pc->start_time);
+  perf_read(pc, pc->start);
+}
+
+void perf_end(PerfCounters *pc, const int phase, const size_t numobj) {
+  trace_end(phase, pc->trace_start, numobj);
+  if (!pc->enabled) return;
+
+  uint64_t now[NUM_COUNTERS] = {0};
+  perf_read(pc, now);
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (int c=0; c<NUM_COUNTERS; c++) {
+    pc->total[phase][c] += now[c] - pc->start[c];
+  }
+  pc->seconds[phase] += (end.tv_sec - pc->start_time.tv_sec) + (end.tv_nsec - pc->start_time.tv_nsec) / 1e9;
+  pc->bodies[phase] += numobj;
+}
+
+void perf_report(const PerfCounters *pc) {
+
+  printf("\n%-12s %10s %14s %14s %6s %12s %12s %12s\r\n",
+    "phase", "time[s]", "cycles", "instructions", "IPC", "L1D/body", "LLC/body", "branch/body");
+
+  for (int p=0; p<NUM_PHASES; p++) {
+    const uint64_t *v = pc->total[p];
+    double bodies = pc->bodies[p] > 0 ? pc->bodies[p] : 1;
+    printf("%-12s %10.4lf ", phase_names[p], pc->seconds[p]);
+
+    if (pc->nopen == 0) {
+      printf("%14s %14s %6s %12s %12s %12s\r\n", "n/a", "n/a", "n/a", "n/a", "n/a", "n/a");
+      continue;
+    }
+    printf("%14llu %14llu %6.2lf ", (unsigned long long)v[COUNTER_CYCLES], (unsigned long long)v[COUNTER_INSTRUCTIONS],
+      v[COUNTER_CYCLES] > 0 ? (double)v[COUNTER_INSTRUCTIONS] / v[COUNTER_CYCLES] : 0);
+    for (int c=COUNTER_L1D_MISSES; c<=COUNTER_BRANCH_MISSES; c++) {
+      if (pc->slot[c] >= 0) {
+        printf("%12.3lf ", v[c] / bodies);
+      } else {
+        printf("%12s ", "n/a");
+      }
+    }
+    printf("\r\n");
+  }
+}
+
+void perf_close(PerfCounters *pc) {
+  for (int i=0; i<pc->nopen; i++) {
+    close(pc->fd[i]);
+  }
+  pc->nopen = 0;
+  pc->enabled = 0;
+}
+
+// trace_openしたバッファ(トレースしていなければNULL)
+static Tracer *active_tracer = NULL;
+
+static const char *trace_names[NUM_TRACE_NAMES - NUM_PHASES] = {"step", "flush", "sleep", "fused_step", "plot bins", "neighbor list", "test particles", "force rows"};
+
+void trace_open(Tracer *tr, const char *filename) {
+
+  tr->fp = fopen(filename, "w");
+  if (tr->fp == NULL) {
+    fprintf(stderr, "Couldn't open trace file '%s'\r\n", filename);
+    exit(-1);
+  }
+
+  tr->nthreads = 1;
+#ifdef _OPENMP
+  tr->nthreads = omp_get_max_threads();
+#endif
+  tr->capacity = TRACE_CAPACITY;
+  tr->step = 0;
+  tr->threads = aligned_alloc(64, sizeof(TraceThread) * tr->nthreads);
+  if (tr->threads == NULL) {
+    fprintf(stderr, "Couldn't allocate trace buffer\r\n");
+    exit(-1);
+  }
+  for (int t=0; t<tr->nthreads; t++) {
+    // 記録中にページフォールトが起きないように書いておく
+    tr->threads[t].events = malloc(sizeof(TraceEvent) * tr->capacity);
+    if (tr->threads[t].events == NULL) {
+      fprintf(stderr, "Couldn't allocate trace buffer\r\n");
+      exit(-1);
+    }
+    memset(tr->threads[t].events, 0, sizeof(TraceEvent) * tr->capacity);
+    tr->threads[t].count = 0;
+    tr->threads[t].dropped = 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &tr->origin);
+  active_tracer = tr;
+}
+
+uint64_t trace_begin(void) {
+  if (active_tracer == NULL) return 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - active_tracer->origin.tv_sec) * 1000000000 + now.tv_nsec - active_tracer->origin.tv_nsec;
+}
+
+void trace_end(const int name, const uint64_t begin, const size_t bodies) {
+  if (active_tracer == NULL) return;
+
+  int tid = 0;
+#ifdef _OPENMP
+  tid = omp_get_thread_num();
+#endif
+  if (tid >= active_tracer->nthreads) return;
+  TraceThread *th = &active_tracer->threads[tid];
+  if (th->count == active_tracer->capacity) {
+    th->dropped++;
+    return;
+  }
+  th->events[th->count++] = (TraceEvent) {
+    .begin = begin,
+    .end = trace_begin(),
+    .step = active_tracer->step,
+    .bodies = bodies,
+    .name = name
+  };
+}
+
+void trace_step(const uint32_t step) {
+  if (active_tracer != NULL) active_tracer->step = step;
+}
+
+void trace_close(Tracer *tr) {
+
+  active_tracer = NULL;
+  FILE *fp = tr->fp;
+  size_t dropped = 0;
+
+  // 区間は開始と長さをまとめた"X"イベントにする(時刻の単位はマイクロ秒)
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"my_bouncing3\"}}", (int)getpid());
+  for (int t=0; t<tr->nthreads; t++) {
+    const TraceThread *th = &tr->threads[t];
+    fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+      (int)getpid(), t, t == 0 ? "main" : "worker", t);
+    for (size_t k=0; k<th->count; k++) {
+      const TraceEvent *e = &th->events[k];
+      const char *name = e->name < NUM_PHASES ? phase_names[e->name] : trace_names[e->name - NUM_PHASES];
+      const char *cat = e->name < NUM_PHASES ? "phase" : e->name < TRACE_FUSED_STEP ? "step" : "thread";
+      fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3lf,\"dur\":%.3lf,\"pid\":%d,\"tid\":%d,\"args\":{\"step\":%u,\"bodies\":%u}}",
+        name, cat, e->begin / 1e3, (e->end - e->begin) / 1e3, (int)getpid(), t, e->step, e->bodies);
+    }
+    dropped += th->dropped;
+    free(th->events);
+  }
+  fprintf(fp, "\n],\"otherData\":{\"dropped\":\"%zu\"}}\n", dropped);
+  fclose(fp);
+  free(tr->threads);
+  tr->threads = NULL;
+
+  if (dropped > 0) {
+    fprintf(stderr, "trace buffer was full; dropped %zu spans\r\n", dropped);
+  }
+}
+
+// -aで試すタイルの大きさ(物体数)
+static const int tune_tiles[] = {64, 256, 1024, 4096};
+
+static const char *force_names[NUM_FORCE_METHODS] = {"direct", "tiled"};
+
+// 結果を覚えておくファイル(HOMEがなければ今のディレクトリに置く)
+static void tune_cache_path(char *path, const size_t size) {
+  const char *home = getenv("HOME");
+  if (home != NULL && home[0] != '\0') {
+    snprintf(path, size, "%s/%s", home, TUNE_CACHE);
+  } else {
+    snprintf(path, size, "%s", TUNE_CACHE);
+  }
+}
+
+// 物体数の範囲(2のべき乗ごと)
+static int tune_bucket(size_t numobj) {
+  int bucket = 0;
+  while (numobj > 1) {
+    numobj >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+static int max_threads(void) {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+int load_force_plan(ForcePlan *plan, const size_t numobj) {
+
+  char path[4096], host[256] = "";
+  tune_cache_path(path, sizeof(path));
+  gethostname(host, sizeof(host) - 1);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return 0;
+
+  // 同じホスト・物体数の範囲・スレッド数の上限の行のうち、最後のものを使う
+  int found = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char h[256], method[32];
+    int bucket, threads_max, tile, threads;
+    double seconds;
+    if (sscanf(line, "%255s %d %d %31s %d %d %lf", h, &bucket, &threads_max, method, &tile, &threads, &seconds) != 7) continue;
+    if (strcmp(h, host) != 0 || bucket != tune_bucket(numobj) || threads_max != max_threads()) continue;
+    for (int k=0; k<NUM_FORCE_METHODS; k++) {
+      if (strcmp(method, force_names[k]) == 0 && tile > 0 && threads > 0) {
+        *plan = (ForcePlan) {.method = k, .tile = tile, .threads = threads, .seconds = seconds};
+        found = 1;
+      }
+    }
+  }
+  fclose(fp);
+  return found;
+}
+
+void save_force_plan(const ForcePlan *plan, const size_t numobj) {
+
+  char path[4096], host[256] = "";
+  tune_cache_path(path, sizeof(path));
+  gethostname(host, sizeof(host) - 1);
+  FILE *fp = fopen(path, "a");
+  if (fp == NULL) {
+    fprintf(stderr, "Couldn't write '%s'; tuning will run again next time\r\n", path);
+    return;
+  }
+  fprintf(fp, "%s %d %d %s %d %d %.6g\n", host, tune_bucket(numobj), max_threads(),
+    force_names[plan->method], plan->tile, plan->threads, plan->seconds);
+  fclose(fp);
+}
+
+ForcePlan tune_force(const Object objs[], const size_t numobj, const Condition cond) {
+
+  // 全物体を相手にする先頭のrows個だけの速度を求めて時間を測り、全物体の分に直す
+  // (物体はコピーして使うので、シミュレーションの状態は変わらない)
+  const int threads_max = max_threads();
+  size_t rows = TUNE_PAIRS / (numobj + 1);
+  if (rows < 64 * (size_t)threads_max) rows = 64 * (size_t)threads_max;
+  if (rows > numobj) rows = numobj;
+
+  Object *work = malloc(sizeof(Object) * (numobj + 1));
+  double *ref_vy = malloc(sizeof(double) * (rows + 1));
+  double *ref_vx = malloc(sizeof(double) * (rows + 1));
+  if (work == NULL || ref_vy == NULL || ref_vx == NULL) {
+    fprintf(stderr, "Couldn't allocate tuning bodies\r\n");
+    exit(-1);
+  }
+  memcpy(work, objs, sizeof(Object) * numobj);
+  for (size_t i=0; i<numobj; i++) {
+    work[i].partner = -1;
+  }
+
+  // 基準はmy_update_velocities_rangeの結果(速度の変化の最大に対する割合で差を比べる)
+  my_update_velocities_range(work, numobj, 0, rows, cond);
+  double scale = 0;
+  for (size_t i=0; i<rows; i++) {
+    ref_vy[i] = work[i].vy;
+    ref_vx[i] = work[i].vx;
+    scale = fmax(scale, fmax(fabs(ref_vy[i] - objs[i].vy), fabs(ref_vx[i] - objs[i].vx)));
+  }
+
+  ForcePlan best = {.method = FORCE_DIRECT, .tile = tune_tiles[0], .threads = 1, .seconds = INFINITY};
+  for (int threads=1; ; threads = threads * 2 < threads_max ? threads * 2 : threads_max) {
+    for (int method=0; method<NUM_FORCE_METHODS; method++) {
+      const int ntiles = method == FORCE_TILED ? sizeof(tune_tiles) / sizeof(tune_tiles[0]) : 1;
+      for (int k=0; k<ntiles; k++) {
+        // 全物体が1つのタイルに入る大きさより大きいタイルは試さない
+        if (k > 0 && (size_t)tune_tiles[k - 1] >= numobj) break;
+        const ForcePlan plan = {.method = method, .tile = tune_tiles[k], .threads = threads};
+
+        double fastest = INFINITY, error = 0;
+        for (int r=0; r<TUNE_REPEATS; r++) {
+          for (size_t i=0; i<rows; i++) {
+            work[i].vy = objs[i].vy;
+            work[i].vx = objs[i].vx;
+          }
+          struct timespec t0, t1;
+          clock_gettime(CLOCK_MONOTONIC, &t0);
+          update_velocities_plan(work, numobj, 0, rows, &plan, cond);
+          clock_gettime(CLOCK_MONOTONIC, &t1);
+          fastest = fmin(fastest, (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9);
+          for (size_t i=0; i<rows; i++) {
+            error = fmax(error, fmax(fabs(work[i].vy - ref_vy[i]), fabs(work[i].vx - ref_vx[i])));
+          }
+        }
+
+        // 直接計算と結果が合わないものは選ばない(NaNも含めて、比較が成り立たなければ外す)
+        const double seconds = fastest * numobj / rows;
+        if (!(error <= TUNE_TOLERANCE * scale)) continue;
+        if (seconds < best.seconds) {
+          best = plan;
+          best.seconds = seconds;
+        }
+      }
+    }
+    if (threads == threads_max) break;
+  }
 
-int is_monotonic(double a, double b, double c) {
-  return (a <= b && b <= c) || (c <= b && b <= a);
+  free(work);
+  free(ref_vy);
+  free(ref_vx);
+  return best;
 }
\ No newline at end of file
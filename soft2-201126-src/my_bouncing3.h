@@ -1,3 +1,25 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define MAX_DOMAINS 64 // -pで指定できるプロセス数の上限
+#define BOUNCE_CHUNK 1024 // 反射の判定をまとめて行う物体数
+#define SUN_PERIOD_STEPS 100 // sunで一番内側の円軌道の周期がdtの何倍になるか
+#define ENSEMBLE_MAX_BODIES 16 // -Eで1つの系に入れられる物体数の上限
+#define ENSEMBLE_BLOCK 512 // -Eで1つのスレッドにまとめて渡す系の数
+#define ENSEMBLE_JITTER 0.5 // -Eで2番目以降の系の初期値をずらす幅
+#define EVENT_MARGIN 0.1 // -eで閾値に足して予測する距離(skinに対する割合。予測の直線からはこの半分まで離れてよい)
+#define TRACE_CAPACITY (1 << 16) // -tで1つのスレッドが記録できる区間の数(超えた分は数だけ数えて捨てる)
+#define TUNE_PAIRS (1 << 22) // -aで1回の計測に使う物体のペアの数の目安
+#define TUNE_REPEATS 3 // -aで候補ごとに計測する回数(最も速かった回を使う)
+#define TUNE_TOLERANCE 1e-12 // -aで直接計算との速度の差として許す大きさ(速度の変化の最大に対する割合)
+#define TUNE_CACHE ".my_bouncing3_tune" // -aの結果を覚えておくファイル(HOMEに置く)
+#define HUGE_PAGE_SIZE (2UL << 20) // huge pageの大きさ(x86-64の2MiB)
+#define MAX_NUMA_NODES 64 // ページの置き場所を数えるNUMAノード数の上限
+#define PLACEMENT_SAMPLES 4096 // ページの置き場所を調べるページ数の上限
+
 // シミュレーション条件を格納する構造体
 // 反発係数CORを追加
 typedef struct condition
@@ -7,6 +29,12 @@ typedef struct condition
   const double G; // 重力定数
   const double dt; // シミュレーションの時間幅
   const double cor; // 壁の反発係数
+  const int shade_mass; // 1なら物体数ではなく質量の合計で濃淡をつける
+  const int color; // 1ならANSI 256色で濃淡を表示する
+  const unsigned long seed; // 初期値を生成する乱数の種
+  const double threshold; // 融合する距離の閾値
+  const double skin; // 融合の候補のリストに含める距離の余裕
+  const double encounter; // 二体の自由落下時間がdtのこの倍数より短ければ近接遭遇として扱う(0なら無効)
 } Condition;
 
 // 個々の物体を表す構造体
@@ -16,21 +44,343 @@ typedef struct object
   double y, x;
   double prev_y, prev_x; // 壁からの反発に使用
   double vy, vx;
+  int partner; // 近接遭遇中の相手のインデックス(いなければ-1。find_encountersに渡した範囲の先頭から数える)
+  int id; // 読み込んだ順の番号(並べ替えても変わらない。融合したときは残った方の番号になる)
 } Object;
 
-int my_plot_objects(Object objs[], const size_t numobj, const double t, const Condition cond);
+// -Tで力の源になる物体(質量がcutoffより大きい物体)だけを集めた配列
+// 位置と質量は毎ステップ写し直し、どの物体を集めるかは物体の並びが変わったときだけ選び直す
+typedef struct massive_bodies
+{
+  double cutoff; // この質量以下の物体はテスト粒子(力を受けるが、他の物体を引かない)
+  size_t numobj; // 選び直したときの物体数
+  int valid; // 0なら次に必ず選び直す
+  size_t count, capacity;
+  int *index; // objs[]の中の位置(小さい順)
+  double *m, *y, *x;
+} MassiveBodies;
+
+// 融合の候補となるペア(距離が threshold + skin 未満)のリスト
+// i番目の物体の相手(i < j)は neighbors[offset[i]] 〜 neighbors[offset[i+1]-1] に小さい順に並ぶ
+typedef struct neighbor_list
+{
+  size_t *offset;
+  int *neighbors;
+  double *ref_y, *ref_x; // 作り直したときの位置
+  size_t numobj; // 作り直したときの物体数
+  int valid; // 0なら次に必ず作り直す
+  size_t rebuilds; // 作り直した回数
+  double *slack; // 物体ごとに、候補の相手と融合するまでにあとどれだけ動く必要があるか(相手がいなければINFINITY)
+  unsigned char *candidate; // fused_stepで求めた、融合するかもしれない物体の印
+  double moved2; // 作り直したときからの移動距離の2乗の最大をfused_stepで求めてあればその値(なければ負)
+} NeighborList;
+
+// 融合の候補のペア(i, j)が閾値まで近づく時刻の予測
+// vi, vjは予測したときのversion(どちらかが変わっていたら古い予測として捨てる)
+typedef struct fusion_event
+{
+  double time;
+  int i, j;
+  unsigned vi, vj;
+} FusionEvent;
+
+// timeの小さい順に取り出す二分ヒープ
+typedef struct event_heap
+{
+  FusionEvent *events;
+  size_t size, capacity;
+} EventHeap;
+
+// -eで使う、融合の候補のペアが閾値まで近づく時刻の予測の待ち行列
+// 物体ごとに予測に使った直線(ref_t の位置と速度)を覚えておき、実際の位置がそこから離れたら予測し直す
+typedef struct event_queue
+{
+  double now; // 今のステップの始まりの時刻
+  size_t numobj;
+  size_t rebuilds; // 予測を全て作り直したときのNeighborListのrebuilds
+  EventHeap pending; // 次のステップ以降の予測
+  EventHeap due; // このステップの中で閾値を横切る時刻(ステップの始まりから)
+  double *ref_t, *ref_y, *ref_x, *ref_vy, *ref_vx;
+  unsigned *version; // 予測し直すたびに増やす
+  unsigned char *linear; // このステップで直線に沿って動いたら1(反射や近接遭遇なら0)
+  unsigned char *recheck; // このステップで全ての相手を調べて予測し直すなら1
+  size_t *adj_offset; // i番目の物体の候補の相手(両方向)は adj[adj_offset[i]] 〜 adj[adj_offset[i+1]-1]
+  int *adj;
+  int *again; // 予測した時刻が来たが融合しなかったペア(2個ずつ)
+  size_t nagain, again_capacity;
+  size_t predicted, stale, checked, fused; // 予測した数、捨てた古い予測の数、閾値を横切るか調べたペアの数、融合した数
+} EventQueue;
+
+// 物体の配列に使うページ
+enum { PAGES_DEFAULT, PAGES_THP, PAGES_HUGETLB };
+
+// 物体の配列のページをどのNUMAノードに置くか
+// (PLACE_FIRST_TOUCHは最初に書いたスレッドのノード、PLACE_INTERLEAVEは全ノードに順番に、
+//  PLACE_PARTITIONは移動(fused_step)のループと同じ分け方で各スレッドが自分の分を最初に書く。
+//  -aの力の計算(update_velocities_plan)の分け方とは合うとは限らない)
+enum { PLACE_FIRST_TOUCH, PLACE_INTERLEAVE, PLACE_PARTITION };
+
+// -A, -Nで指定する物体の配列の確保のしかた
+typedef struct memory_policy
+{
+  int pages;
+  int placement;
+} MemoryPolicy;
+
+// alloc_bodiesで確保した領域
+typedef struct body_memory
+{
+  void *ptr;
+  size_t size; // 確保した大きさ(mmapしたときはページの大きさの倍数)
+  int mapped; // 1ならmmapで確保した(0ならmalloc)
+  int pages; // 実際に使ったページ(huge pageが足りなければ要求と違うことがある)
+  int placement;
+} BodyMemory;
+
+// 複数のプロセスで共有する領域(POSIX共有メモリに置く)
+// 物体は領域の順に並べ、d番目の領域の物体は objs[start[d]] 〜 objs[start[d]+count[d]-1] にある
+typedef struct domain_shared
+{
+  pthread_barrier_t barrier; // ステップの区切りで全プロセスが待ち合わせる
+  int nproc;
+  volatile int stop; // 1なら子プロセスを終了させる
+  size_t size; // 共有メモリの大きさ
+  size_t numobj;
+  size_t start[MAX_DOMAINS];
+  size_t count[MAX_DOMAINS];
+  pid_t pid[MAX_DOMAINS];
+  Object objs[];
+} DomainShared;
+
+// 物体数が同じ独立した小さな系をnumsys個並べたもの
+// i番目の物体のs番目の系での値は y[i * numsys + s] にあり、隣の系が隣のSIMDレーンに入る
+typedef struct ensemble
+{
+  size_t numsys;
+  size_t numbody;
+  double *m; // 融合で消えた物体は0
+  double *y, *x;
+  double *prev_y, *prev_x;
+  double *vy, *vx;
+  unsigned char *active; // 系ごとに、まだ進めるなら1(物体が1つになったら0)
+  double *finished_at; // 系ごとに物体が1つになった時刻(まだならINFINITY)
+  size_t steps;
+} Ensemble;
+
+// ハードウェアカウンタで数える段階(反射は移動と同じループで行うのでPHASE_DRIFTに含める)
+enum { PHASE_FORCE, PHASE_DRIFT, PHASE_FUSION, PHASE_SORT, PHASE_RENDER, NUM_PHASES };
+
+// -tで記録する区間(段階の後に続ける。TRACE_FUSED_STEP以降はスレッドごとに記録する)
+enum { TRACE_STEP = NUM_PHASES, TRACE_FLUSH, TRACE_SLEEP, TRACE_FUSED_STEP, TRACE_PLOT_BINS, TRACE_NEIGHBORS, TRACE_TEST_PARTICLES, TRACE_FORCE_ROWS, NUM_TRACE_NAMES };
+
+// 記録した1つの区間(時刻はトレースを始めたときからのナノ秒)
+typedef struct trace_event
+{
+  uint64_t begin, end;
+  uint32_t step;
+  uint32_t bodies; // その区間で扱った物体数(段階なら全体、スレッドごとの区間ならそのスレッドの分)
+  int name;
+} TraceEvent;
+
+// スレッドごとの記録(他のスレッドと同じキャッシュラインに書かないように揃える)
+typedef struct trace_thread
+{
+  _Alignas(64) TraceEvent *events;
+  size_t count;
+  size_t dropped; // 一杯で捨てた区間の数
+} TraceThread;
+
+// -tで区間を記録するバッファ(始める前に全て確保して書いておく)
+typedef struct tracer
+{
+  FILE *fp;
+  int nthreads;
+  size_t capacity;
+  struct timespec origin;
+  volatile uint32_t step; // 今のステップ(メインのスレッドが並列の区間の外で書く)
+  TraceThread *threads;
+} Tracer;
+
+// 力の計算のしかた(FORCE_DIRECTは物体の配列をそのまま、FORCE_TILEDは相手の位置と質量を詰めてタイルに分ける)
+enum { FORCE_DIRECT, FORCE_TILED, NUM_FORCE_METHODS };
+
+// -aで選んだ力の計算のしかた
+typedef struct force_plan
+{
+  int method;
+  int tile; // FORCE_TILEDで1つのタイルに入れる相手の数
+  int threads;
+  double seconds; // 測った1ステップあたりの時間(全物体の分に直したもの)
+} ForcePlan;
+
+// 数えるイベント
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_L1D_MISSES, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES, NUM_COUNTERS };
+
+// perf_event_openで開いたカウンタと段階ごとの合計
+typedef struct perf_counters
+{
+  int enabled;
+  int nopen; // 開けたカウンタの数(0ならかかった時間だけ数える)
+  int fd[NUM_COUNTERS]; // fd[0]がグループの先頭
+  int slot[NUM_COUNTERS]; // イベントごとのグループ内の位置(開けなかったら-1)
+  uint64_t start[NUM_COUNTERS];
+  struct timespec start_time;
+  uint64_t total[NUM_PHASES][NUM_COUNTERS];
+  double seconds[NUM_PHASES];
+  uint64_t bodies[NUM_PHASES]; // 段階ごとの物体数の合計(1個あたりに直すため)
+  uint64_t trace_start; // -tのときにperf_beginで取った時刻
+} PerfCounters;
+
+// index_ofは物体の番号から配列の位置を引く表(番号の小さい順に座標を表示する)
+// cellがNULLでなければ各物体の表示するマスとして使う
+int my_plot_objects(Object objs[], const size_t numobj, const int cell[], const int index_of[], const size_t numids, const double t, const Condition cond);
 void my_update_velocities(Object objs[], const size_t numobj, const Condition cond);
+
+// objs[begin]〜objs[end-1]の速度だけを、全物体から受ける力で更新する
+void my_update_velocities_range(Object objs[], const size_t numobj, const size_t begin, const size_t end, const Condition cond);
+
+// my_update_velocities_rangeと同じ結果を、planの方法とスレッド数で求める
+void update_velocities_plan(Object objs[], const size_t numobj, const size_t begin, const size_t end, const ForcePlan *plan, const Condition cond);
 void my_update_positions(Object objs[], const size_t numobj, const Condition cond);
+// 近接遭遇している二体を探してpartnerを設定し、ペアの数を返す
+size_t find_encounters(Object objs[], const size_t numobj, const Condition cond);
+
+// 質量がmb->cutoffより大きい物体を選んでmb->index[]に集め、その位置と質量を写す
+void gather_massive(const Object objs[], const size_t numobj, MassiveBodies *mb);
+void free_massive(MassiveBodies *mb);
+
+// find_encountersと同じ判定を、gather_massiveで集めた物体同士だけで行う(テスト粒子は近接遭遇として扱わない)
+size_t find_massive_encounters(Object objs[], const MassiveBodies *mb, const Condition cond);
+
+// gather_massiveで集めた物体から受ける力だけで速度を更新する(テスト粒子は相手の配列をベクトル化して足す)
+void update_velocities_test(Object objs[], const size_t numobj, const MassiveBodies *mb, const Condition cond);
+
+// 近接遭遇中の二体の相対運動を正則化して1ステップ分積分する
+void integrate_encounter(Object *o1, Object *o2, const Condition cond);
+
+// 画面端を横切った物体を反発係数で折り返す(分岐なし)
 void my_bounce(Object objs[], const size_t numobj, const Condition cond);
 
-// 座標が画面内にあるかどうか判定する
-int in_screen(double y, double x, const Condition cond);
+// 表示する盤面(枠を含む)のマスの番号。盤面の外なら-1
+int screen_cell(const double y, const double x, const Condition cond);
 
-// a, b, cがこの順に単調増加または単調減少であるかどうかを判定する
-int is_monotonic(double a, double b, double c);
+// my_update_positionsとmy_bounceを行い、ついでに融合の候補のリストを作り直したときからの移動距離の2乗の最大と、
+// 各物体の表示するマスをcell[]に、融合するかもしれない物体の印をlist->candidate[]に求める。
+// 物体の配列はキャッシュに収まるまとまりごとに1回だけ読む
+// (listが今の並びのものでなければ移動距離は求めずに負の値を返す。pairsは近接遭遇中のペアの数)
+double fused_step(Object objs[], const size_t numobj, const size_t pairs, NeighborList *list, int cell[], const Condition cond);
 
 // オブジェクトファイルを読み込む
 void load_objects(size_t numobj, Object objs[], char filename[], const Condition cond);
 
+// Philox4x32-10でカウンタctrを暗号化する(結果はctrに上書きする)
+void philox4x32(uint32_t ctr[4], const uint32_t key[2]);
+
+// 種seedとindex番目の物体のk番目の値から決まる(0, 1)の一様乱数
+double random_uniform(const unsigned long seed, const uint64_t index, const uint32_t k);
+
+// kindで指定した分布でobjs[begin]〜objs[numobj-1]を生成する。kindが生成器の名前でなければ0を返す
+int generate_objects(const char *kind, const size_t begin, const size_t numobj, Object objs[], const Condition cond);
+
+// 画面の2倍の範囲を65536x65536に分けた格子の座標をビットごとに交互に並べたMortonコード(Z曲線の順番)
+uint32_t morton_code(const double y, const double x, const Condition cond);
+
+// 物体をMortonコードの順に並べ替える(同じコードの物体は元の順番を保つ)
+void morton_sort(Object objs[], const size_t numobj, const Condition cond);
+
+// keys[]の小さい順になるようにorder[]を並べ替える(8ビットずつの基数ソートをスレッドで分けて行う)
+void radix_sort(uint32_t keys[], uint32_t order[], const size_t n);
+
+// 物体の番号からobjs[]の中の位置を引く表を作り直す(融合で消えた番号は-1)
+void update_id_map(const Object objs[], const size_t numobj, int index_of[], const size_t numids);
+
 // 近いオブジェクト同士を融合させる
-void fusion_objects(Object objs[], size_t *numobj, const Condition cond);
\ No newline at end of file
+void fusion_objects(Object objs[], size_t *numobj, NeighborList *list, const Condition cond);
+
+// 物体が余裕の半分以上動いていたら融合の候補のリストを作り直す
+void update_neighbor_list(const Object objs[], const size_t numobj, NeighborList *list, const Condition cond);
+void build_neighbor_list(const Object objs[], const size_t numobj, NeighborList *list, const Condition cond);
+void free_neighbor_list(NeighborList *list);
+
+// 融合で消えた物体を除き、番号をnew_index[](消えた物体は-1)に付け替える
+// 作り直したときの位置はそのままなので、その後も移動距離で作り直すかを判定できる
+void compact_neighbor_list(NeighborList *list, const int new_index[]);
+
+// fusion_objectsの代わりに、予測した時刻が来たペアと予測から外れた物体のペアだけを調べて融合させる
+// 融合はステップの中で閾値を横切った時刻に行い、残りの時間は合成した速度で進める
+// (調べるのは候補のリストのペアだけなので、1ステップでskin/2より動く物体があると途中で横切ったペアを見逃すことがある)
+void fusion_events(Object objs[], size_t *numobj, NeighborList *list, EventQueue *queue, const Condition cond);
+void free_event_queue(EventQueue *queue);
+
+// 1個elemバイトの要素をcount個置ける領域をpolicyに従って確保する(確保できなければNULLを返す)
+// policyが既定のままならmallocと同じ。ページは確保したときに全て書いて割り当てておく
+void *alloc_bodies(BodyMemory *mem, const size_t count, const size_t elem, const MemoryPolicy policy);
+void free_bodies(BodyMemory *mem);
+
+// 確保した領域のページの大きさと、NUMAノードごとのページの割合を表示する
+void report_bodies(const BodyMemory *mem, const char *name);
+
+// capacity個の物体を置ける共有メモリを作り、nproc個のプロセスで使うバリアを用意する
+DomainShared *create_domains(const size_t capacity, const int nproc);
+
+// 子プロセスを作る。子プロセスでは自分の番号(1〜nproc-1)、親では0を返す
+int fork_domains(DomainShared *sh);
+
+// rank番目の領域の物体を1ステップ進める。終了するときは0を返す
+int domain_step(DomainShared *sh, const int rank, const Condition cond);
+
+// x座標がどの領域に入るかを求める
+int domain_of(const double x, const int nproc, const Condition cond);
+
+// 物体を領域の順に並べ替える。並び順が変わったら1を返す
+int migrate_domains(DomainShared *sh, const Condition cond);
+
+// 子プロセスを終了させて共有メモリを解放する
+void destroy_domains(DomainShared *sh);
+
+// objs[0]〜objs[numbody-1]の系をnumsys個並べる(2番目以降は初期値を乱数で少しずらす)
+void init_ensemble(Ensemble *ens, const Object objs[], const size_t numbody, const size_t numsys, const Condition cond);
+void free_ensemble(Ensemble *ens);
+
+// 全ての系で近い物体同士を融合させる(物体が1つになった系は止める)
+void fuse_ensemble(Ensemble *ens, const Condition cond);
+
+// 全ての系を1ステップ進め(力、移動、反射、融合)、まだ進めている系の数を返す
+size_t ensemble_step(Ensemble *ens, const double t, const Condition cond);
+
+// 全ての系が1つの物体になるかstop_timeまで進め、残った物体数などをまとめて表示する
+void run_ensemble(const Object objs[], const size_t numbody, const size_t numsys, const double stop_time, const Condition cond);
+
+// カウンタを開いて数え始める。開けなければかかった時間だけ数える
+void perf_open(PerfCounters *pc);
+
+// perf_beginからperf_endまでの分をphaseに足す(有効でなければ何もしない。-tのときはトレースにも記録する)
+void perf_begin(PerfCounters *pc);
+void perf_end(PerfCounters *pc, const int phase, const size_t numobj);
+
+// 段階ごとのIPCや物体1個あたりのミス数を表示する
+void perf_report(const PerfCounters *pc);
+void perf_close(PerfCounters *pc);
+
+// filenameにトレースを書くためにバッファを用意し、以降のtrace_endを記録させる(開けなければ終了する)
+void trace_open(Tracer *tr, const char *filename);
+
+// トレースを始めてからの時刻(ナノ秒)。トレースしていなければ0
+uint64_t trace_begin(void);
+
+// trace_beginで取った時刻beginから今までを、呼んだスレッドの区間nameとして記録する
+void trace_end(const int name, const uint64_t begin, const size_t bodies);
+
+// 以降の区間に付けるステップの番号
+void trace_step(const uint32_t step);
+
+// 記録した区間をChromeのtrace event形式(JSON)で書き出してバッファを解放する
+void trace_close(Tracer *tr);
+
+// 読み込んだ物体で力の計算の方法・タイルの大きさ・スレッド数の組み合わせを測り、
+// my_update_velocities_rangeとの差がTUNE_TOLERANCE以内のうち最も速いものを返す
+ForcePlan tune_force(const Object objs[], const size_t numobj, const Condition cond);
+
+// このホスト・物体数の範囲・スレッド数の上限でtune_forceした結果があれば読み込んで1を返す
+int load_force_plan(ForcePlan *plan, const size_t numobj);
+void save_force_plan(const ForcePlan *plan, const size_t numobj);
\ No newline at end of file
@@ -64,6 +64,65 @@
     太陽と地球と月(実際の公転周期より少し短くなってしまう)
     ./a.out moon 27.3 0.05
     ./a.out moon 365 0.1
+
+  実行速度は -s オプションで[日/秒]単位で指定できる。
+  締め切り(1/60秒ごと)の絶対時刻を基準にして進めるので、計算や表示にかかる時間で速さがずれない。
+  計算が遅れたときは1フレームで複数ステップ進めて追いつき、終了時に実際の速さと目標を表示する。
+    ./a.out -s 1000 data4_solar_system.dat 4329 3 2
+
+  実行中はキー入力で表示範囲を変えられる。
+    +/-: 拡大・縮小, h/j/k/l または矢印キー: 移動, f: 追従する物体を切り替え, 0: 元に戻す, スペース: 一時停止, q: 終了
+  -k で指定したステップごとに、力の計算のついでにポテンシャルエネルギーを求め、
+  エネルギー・運動量・角運動量の初期値からのずれを表示する(指定しなければ計算しない)。
+    ./a.out -k 10 moon 365 0.1
+  表示範囲の外にある物体は座標変換する前に除外する。
+
+  -P で名前を指定すると、毎ステップの全物体の状態をその名前のPOSIX共有メモリに公開する。
+  書き込みはseqlock(書き込み中は通し番号が奇数)なので、シミュレーション側は待たされない。
+  読む側は通し番号が書き込み前後で変わっていないことを確かめて一貫した状態を得る(my_viewer4.c を参照)。
+    ./a.out -P /my_bouncing4 data4_solar_system.dat 4329 3 2
+
+  -o で毎ステップの状態をファイルに記録し、-r でそれを再生できる(再計算はしない)。
+  ファイルはフレームの位置の表を持ち、フレームは等間隔なので、どの時刻にもO(1)で移動できる。
+  ファイルはmmapで読み、フレームの中身はそのまま描画に渡す。
+  再生中は上のキーに加えて、<,>: 速さを半分・2倍, r: 逆再生, [,]: 5秒分戻る・進む, g,G: 先頭・末尾
+    ./a.out -o neptune.traj data4_solar_system.dat 60148 10 2
+    ./a.out -s 20000 -r neptune.traj
+  -q で位置の誤差の上限[km]を指定すると、位置と速度をその幅に量子化して圧縮して記録する(-r はそのまま使える)。
+  速度の上限は -Q [m/s]で指定でき、省略すると1ステップの間に位置の上限だけずれる速さになる。
+  各値を直前の3フレームから外挿した予測との差にして、ライス符号(パラメータは物体・成分ごとに残差の平均から決める)で書く。
+  64フレームごとにキーフレームを置き、移動したときはその前のキーフレームから復元する。
+    ./a.out -o neptune.traj -q 1000 data4_solar_system.dat 60148 10 2
+
+  -i で積分法を選べる(euler: 今までと同じ、leapfrog: 2次のシンプレクティック、rk4: 4次のルンゲ・クッタ、
+  ias15: 15次のガウス・ラダウ法)。
+  ias15 は -e で指定した許容誤差(デフォルト1e-9)から刻み幅を自動で選び、変化がゆっくりなところでは大きく、
+  近づいたところでは小さく進める。このとき引数の時間刻み幅は表示・記録の間隔としてだけ使う。
+  刻み幅は、終点での加速度とその微分から求めた各物体の変化の時間スケールのうち最も短いものに合わせる。
+  1ステップ内の加速度を時間の7次式で表し、7つの分点で力を計算して係数が変わらなくなるまで繰り返す。
+  次のステップの係数は今のステップの式を延ばして予測するので、普段は2,3回の繰り返しで済む。
+    ./a.out -i ias15 data4_solar_system.dat 60148 10 2
+    ./a.out -i ias15 -e 1e-12 moon 27.3 0.05
+  -b を付けると、上の実行例の各惑星と月について、積分法と時間刻み幅(ias15は許容誤差)の組み合わせごとに1周期分を計算し、
+  かかった時間、エネルギーのずれ、1周後に元の位置に戻らなかった距離、細かい刻み幅のrk4との距離を表示する。
+  時間と誤差の両方で他に負けていない組み合わせ(パレート最適)には * が付く。
+  (月が元の位置に戻らないのはどの積分法でも同じなので、刻み幅ではなく初期値や周期の値によるもの。)
+    ./a.out -b
+
+  -I で端末の代わりにPPM画像の連番に書き出す(-r と一緒に使うと記録した軌道を画像にする)。
+  大きさは -S (デフォルト1920x1080)で、端末と同じ範囲が画像の高さに収まる。点の半径は一番軽い物体との質量比の対数で決め、
+  -T で指定した枚数分の過去の位置を、古いほど暗い線で軌跡として描く。-n で何ステップごとに1枚描くかを指定する。
+  シミュレーションのスレッドは位置をピクセルに直して渡すだけで、描画とファイルへの書き出しは -j 個のスレッドで並列に行う。
+  画像に書き出すときは保存量の表示(-k)、共有メモリへの公開(-P)、軌道の記録(-o)はできないので、一緒に指定するとエラーにする。
+    ./a.out -I frames/neptune -S 3840x2160 -T 200 -n 10 data4_solar_system.dat 60148 10 2
+    ./a.out -I frames/moon -T 100 -r moon.traj
+
+  描画は別スレッドで行う。シミュレーションは毎ステップの位置を三重バッファに書き込むだけで、
+  描画スレッドは一定間隔で最新のフレームだけを表示する(表示する前に新しいフレームが来たら古い方は置き換える)。
+  そのため端末への出力が遅くてもシミュレーションは遅くならない。
+
+  コンパイル:
+    gcc -Wall -O2 -pthread my_bouncing4.c -lm
 */
 
 #include <stdio.h>
@@ -72,15 +131,110 @@
 #include <math.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "my_bouncing4.h"
 
 int main(int argc, char **argv)
 {
 
-  if (argc < 2) {
+  double speed = 0; // 目標の速さ[日/秒] (0ならシミュレーション時間に応じて決める)
+  int report_every = 0; // 保存量を何ステップごとに計算するか(0なら計算しない)
+  char *publish_name = NULL; // 状態を公開する共有メモリの名前
+  char *record_name = NULL; // 軌道を記録するファイル
+  char *replay_name = NULL; // 再生する軌道のファイル
+  int integrator = INTEGRATOR_EULER;
+  double tolerance = 1e-9; // ias15 の許容誤差
+  int benchmark = 0;
+  int terminal_only = 0; // 端末に表示するときだけ使えるオプション(-k, -P, -o)が指定されたか
+  ImageOptions image = {.prefix = NULL, .width = 1920, .height = 1080, .trail = 0, .every = 1};
+  image.workers = sysconf(_SC_NPROCESSORS_ONLN) > 2 ? sysconf(_SC_NPROCESSORS_ONLN) - 1 : 1; // 1つはシミュレーションに残す
+  double pos_error = 0; // 記録する位置の誤差の上限[km] (0なら圧縮しない)
+  double vel_error = 0; // 記録する速度の誤差の上限[m/s] (0なら1ステップで位置の上限だけずれる速さ)
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:k:P:o:r:i:e:bq:Q:I:S:T:n:j:")) != -1) {
+    switch (opt) {
+      case 's':
+        speed = atof(optarg);
+        break;
+      case 'k':
+        report_every = atoi(optarg);
+        terminal_only = 1;
+        break;
+      case 'P':
+        publish_name = optarg;
+        terminal_only = 1;
+        break;
+      case 'o':
+        record_name = optarg;
+        terminal_only = 1;
+        break;
+      case 'r':
+        replay_name = optarg;
+        break;
+      case 'i':
+        integrator = integrator_by_name(optarg);
+        if (integrator < 0) argc = 0;
+        break;
+      case 'e':
+        tolerance = atof(optarg);
+        break;
+      case 'b':
+        benchmark = 1;
+        break;
+      case 'q':
+        pos_error = atof(optarg);
+        break;
+      case 'Q':
+        vel_error = atof(optarg);
+        break;
+      case 'I':
+        image.prefix = optarg;
+        break;
+      case 'S':
+        if (!parse_image_size(optarg, &image.width, &image.height)) argc = 0;
+        break;
+      case 'T':
+        image.trail = atoi(optarg);
+        if (image.trail < 0 || image.trail >= MAX_TRAIL) argc = 0;
+        break;
+      case 'n':
+        image.every = atoi(optarg);
+        if (image.every < 1) argc = 0;
+        break;
+      case 'j':
+        image.workers = atoi(optarg);
+        if (image.workers < 1) argc = 0;
+        break;
+      default:
+        argc = 0; // 使い方を表示させる
+    }
+  }
+
+  // オプションを除いた引数
+  int nargs = argc - optind;
+  char **args = argv + optind;
+
+  // 再生するときは記録したときの条件を使う
+  Trajectory traj = {0};
+  if (replay_name != NULL) open_trajectory(&traj, replay_name);
+
+  if (nargs < 1 && replay_name == NULL && !benchmark) {
     //ファイル名 (シミュレーション時間[日] 時間刻み幅[日] 縮尺[au/高さ1マス])
-    fprintf(stderr, "usage:\t%s <filename> [<days> <dt> <scale>]\n\t%s moon <days> <dt>\n", argv[0], argv[0]);
+    fprintf(stderr, "usage:\t%s [options] <filename> [<days> <dt> <scale>]\n\t%s [options] moon <days> <dt>\n\t%s [options] -r <trajectory>\n\t%s -b [<filename>]\n", argv[0], argv[0], argv[0], argv[0]);
+    fprintf(stderr, "options:\n\t-s <days/sec>\ttarget speed\n\t-k <steps>\tconservation report interval (default: off)\n\t-P <name>\tpublish state to shared memory <name>\n\t-o <file>\trecord trajectory to <file>\n\t-r <file>\treplay trajectory <file>\n\t-i <name>\tintegrator (euler, leapfrog, rk4, ias15)\n\t-e <tol>\tias15 error tolerance (default 1e-9)\n\t-b\t\tbenchmark integrators and step sizes\n\t-q <km>\t\tcompress recorded positions to this error bound\n\t-Q <m/s>\tcompress recorded velocities to this error bound\n\t-I <prefix>\twrite frames to <prefix>000000.ppm, ... instead of the terminal\n\t-S <w>x<h>\timage size (default 1920x1080)\n\t-T <n>\t\tmotion trail length in images\n\t-n <steps>\tsteps (or recorded frames) per image\n\t-j <threads>\timage threads\n");
+    return 1;
+  }
+
+  if (image.prefix != NULL && terminal_only) {
+    fprintf(stderr, "%s: -k, -P and -o cannot be used with -I\n", argv[0]);
     return 1;
   }
 
@@ -88,51 +242,274 @@ int main(int argc, char **argv)
 		    .width  = 75,
 		    .height = 38,
 		    .G = 6.67430e-11,
-		    .dt = 60*60*24 * (argc >= 4 ? atof(argv[3]) : 1),
+		    .dt = (replay_name != NULL ? traj.header.dt : 60*60*24 * (nargs >= 3 ? atof(args[2]) : 1)),
         .au = 149597870700,
         .earth_to_moon = 384400000,
-        .scale = (argc >= 5 ? atof(argv[4]) : 0.1),
-        .moon = (strcmp(argv[1], "moon") == 0 ? 1 : 0)
+        .scale = (replay_name != NULL ? traj.header.scale : nargs >= 4 ? atof(args[3]) : 0.1),
+        .moon = (replay_name != NULL ? traj.header.moon : nargs >= 1 && strcmp(args[0], "moon") == 0 ? 1 : 0)
   };
+
+  if (benchmark) {
+    run_benchmark(nargs >= 1 ? args[0] : "data4_solar_system.dat", cond);
+    return EXIT_SUCCESS;
+  }
+
+  if (replay_name != NULL && image.prefix != NULL) {
+    render_trajectory_images(&traj, image, cond);
+    close_trajectory(&traj);
+    return EXIT_SUCCESS;
+  }
+
+  if (replay_name != NULL) {
+    replay_trajectory(&traj, speed, cond);
+    close_trajectory(&traj);
+    return EXIT_SUCCESS;
+  }
   
   size_t objnum = 0;
-  Object objects[100];
+  Object objects[MAX_OBJECTS];
 
-  load_objects(objects, &objnum, argv[1], cond);
+  load_objects(objects, &objnum, args[0], cond);
+  Integrator integ = create_integrator(integrator, tolerance);
 
   // シミュレーション. ループは整数で回しつつ、実数時間も更新する
-  const double stop_time = (argc >= 3 ? atof(argv[2]) : 365) * 60 * 60 * 24;
+  const double stop_time = (nargs >= 2 ? atof(args[1]) : 365) * 60 * 60 * 24;
   double t = 0;
-  int line = 0; // 表示した行数
-  
-  line = my_plot_objects(objects, objnum, t, cond);
-  usleep(1000 * 1000); //初期配置が分かるように一時停止
-
-  for (int i = 0 ; t < stop_time ; i++) {
 
-    if (line > 0) printf("\e[%dA", line); // カーソルを表示した分だけ上に戻す
-    line = 0;
+  // 画像に書き出すときは端末に表示せず、実時間にも合わせない
+  if (image.prefix != NULL) {
+    render_images(objects, objnum, &integ, stop_time, image, cond);
+    return EXIT_SUCCESS;
+  }
 
-    t = i * cond.dt;
-    my_update_positions(objects, objnum, cond);
-    my_update_velocities(objects, objnum, cond);
-    
-    // 表示の座標系は width/2, height/2 のピクセル位置が原点となるようにする
-    // ただし、月は地球を中心として、別スケールで描画する
-    line += my_plot_objects(objects, objnum, t, cond);
-    
-    // シミュレーション時間が長いほどスリープ時間を短くする
+  // 目標の速さが指定されなければ、以前の1ステップごとのスリープと同じ程度の速さにする
+  // (月のモードは1ステップ1ms、それ以外はシミュレーション時間が長いほど速くする)
+  if (speed <= 0) {
     if (cond.moon) {
-      usleep(1 * 1000);
+      speed = cond.dt / (60 * 60 * 24) * 1000;
     } else {
-      usleep(10 * 1000 / (stop_time / (60 * 60 * 24 * 265)));
+      speed = stop_time / (60 * 60 * 24) * (cond.dt / (60 * 60 * 24)) / 2.65;
+    }
+  }
+  const double ratio = speed * 60 * 60 * 24; // 実時間1秒あたりのシミュレーション時間[秒]
+
+  View view = {.scale = cond.scale, .cy = 0, .cx = 0, .follow = -1, .paused = 0};
+
+  // 描画スレッドとの受け渡しに使う三重バッファ(大きいのでstaticに置く)
+  static FrameRing ring;
+  ring_init(&ring);
+  RenderArgs render_args = {.ring = &ring, .cond = cond, .line = 0};
+
+  // 保存量の初期値。以降はreport_everyステップごとに力の計算のついでに求めたポテンシャルと比べる
+  Diagnostics diag = {0};
+  if (report_every > 0) {
+    double ay[MAX_OBJECTS], ax[MAX_OBJECTS];
+    compute_accelerations(objects, objnum, ay, ax, cond, &diag.potential);
+    measure_conserved(objects, objnum, &diag);
+  }
+  render_args.initial = diag;
+
+  render_args.line = my_plot_objects(objects, objnum, t, view, cond);
+  usleep(1000 * 1000); //初期配置が分かるように一時停止
+
+  pthread_t render;
+  if (pthread_create(&render, NULL, render_thread, &render_args) != 0) {
+    fprintf(stderr, "Couldn't create render thread\r\n");
+    return 1;
+  }
+
+  enable_raw_input();
+
+  // 外部のビューアから読めるように、毎ステップの状態を共有メモリに公開する
+  PublishedState *published = NULL;
+  if (publish_name != NULL) {
+    published = create_published_state(publish_name);
+    publish_state(published, objects, objnum, t);
+  }
+
+  // 毎ステップの状態をファイルに記録する
+  TrajectoryWriter *writer = NULL;
+  if (record_name != NULL) {
+    writer = open_trajectory_writer(record_name, cond, pos_error * 1000, vel_error > 0 ? vel_error : pos_error * 1000 / cond.dt);
+  }
+
+  size_t frames = 0; // 締め切りの数
+  size_t missed = 0; // 計算が間に合わずに飛ばした締め切りの数
+
+  // 1/REFRESH_RATE秒ごとの締め切りまでに、その時刻に対応するシミュレーション時間まで進めておく
+  // 遅れているときは1フレームで何ステップも進め、それでも間に合わなければフレームを飛ばす
+  struct timespec start, deadline;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  deadline = start;
+
+  int i = 0;
+  while (t < stop_time) {
+
+    timespec_add_ns(&deadline, 1000L * 1000 * 1000 / REFRESH_RATE);
+    frames++;
+
+    // キー入力はフレームごとに溜まっている分だけ読む(待たない)
+    View prev_view = view;
+    if (!poll_keys(&view, NULL, objnum, cond)) break;
+    int view_changed = memcmp(&prev_view, &view, sizeof(View)) != 0;
+
+    // 一時停止中は基準時刻をずらして、再開したときにまとめて進まないようにする
+    if (view.paused) {
+      timespec_add_ns(&start, 1000L * 1000 * 1000 / REFRESH_RATE);
+    }
+
+    // 次の締め切りの時点で到達しているべきシミュレーション時間
+    const double target = timespec_diff(&deadline, &start) * ratio;
+
+    int stepped = 0;
+    while (!view.paused && t < stop_time && i * cond.dt <= target) {
+      t = i * cond.dt;
+      if (report_every > 0 && (i + 1) % report_every == 0) {
+        diag.potential = 0;
+        integrate_step(objects, objnum, &integ, cond, &diag.potential);
+        measure_conserved(objects, objnum, &diag);
+      } else {
+        integrate_step(objects, objnum, &integ, cond, NULL);
+      }
+      i++;
+      stepped = 1;
+      if (published != NULL) publish_state(published, objects, objnum, t);
+      if (writer != NULL) write_trajectory_frame(writer, objects, objnum, t);
+
+      // 締め切りを過ぎたら一旦表示に回す(残りは次のフレームで追いつく)
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (timespec_diff(&now, &deadline) > 0) break;
     }
+
+    if (stepped || view_changed) ring_push(&ring, objects, objnum, t, view, diag);
+
+    // 締め切りを過ぎていれば眠らず、過ぎてしまった締め切りは飛ばす
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (timespec_diff(&now, &deadline) > 0) {
+      timespec_add_ns(&deadline, 1000L * 1000 * 1000 / REFRESH_RATE);
+      missed++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  // 描画スレッドに最後のフレームを表示させてから終了させる
+  ring_push(&ring, objects, objnum, t, view, diag);
+  atomic_store_explicit(&ring.done, 1, memory_order_release);
+  pthread_join(render, NULL);
+  restore_input();
+
+  if (writer != NULL) close_trajectory_writer(writer);
+
+  if (published != NULL) {
+    atomic_store_explicit(&published->done, 1, memory_order_release);
+    destroy_published_state(published, publish_name);
+  }
+
+  if (report_every > 0) print_conservation(&render_args.initial, &diag);
+  printf("rendered %zu frames, skipped %zu stale frames\r\n",
+    render_args.rendered, render_args.skipped);
+  printf("speed: %.2lf days/sec (target %.2lf days/sec), missed %zu of %zu frame deadlines\r\n",
+    t / (60 * 60 * 24) / timespec_diff(&end, &start), speed, missed, frames + missed);
+  if (integ.method == INTEGRATOR_IAS15) {
+    printf("ias15: %zu steps (%.3lf days on average), %zu force evaluations, %zu rejected steps\r\n",
+      integ.steps, t / integ.steps / (60 * 60 * 24), integ.evaluations, integ.rejected);
   }
 
   return EXIT_SUCCESS;
 }
 
-int my_plot_objects(Object objs[], const size_t numobj, const double t, const Condition cond) {
+void timespec_add_ns(struct timespec *ts, const long ns) {
+  ts->tv_nsec += ns;
+  while (ts->tv_nsec >= 1000L * 1000 * 1000) {
+    ts->tv_nsec -= 1000L * 1000 * 1000;
+    ts->tv_sec++;
+  }
+}
+
+double timespec_diff(const struct timespec *a, const struct timespec *b) {
+  return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+void ring_init(FrameRing *ring) {
+  ring->back = 0;
+  atomic_store_explicit(&ring->middle, 1, memory_order_relaxed);
+  ring->front = 2;
+  ring->pushed = 0;
+  ring->taken = 0;
+  atomic_store_explicit(&ring->done, 0, memory_order_relaxed);
+}
+
+void ring_push(FrameRing *ring, const Object objs[], const size_t numobj, const double t, const View view, const Diagnostics diag) {
+
+  // backは描画スレッドが触らないので、そのまま書いてよい
+  Frame *frame = &ring->frames[ring->back];
+  frame->t = t;
+  frame->numobj = numobj;
+  frame->view = view;
+  frame->diag = diag;
+  frame->seq = ++ring->pushed;
+  memcpy(frame->objs, objs, sizeof(Object) * numobj);
+
+  // 書き終えたフレームを受け渡し用と交換する。前のフレームがまだ読まれていなければ、それが次の書き込み先になる
+  int old = atomic_exchange_explicit(&ring->middle, ring->back | RING_FRESH, memory_order_acq_rel);
+  ring->back = old & ~RING_FRESH;
+}
+
+const Frame *ring_latest(FrameRing *ring, size_t *skipped) {
+
+  if (!(atomic_load_explicit(&ring->middle, memory_order_relaxed) & RING_FRESH)) return NULL;
+
+  // 表示し終わったフレームを受け渡し用と交換して、最新のフレームを受け取る
+  int old = atomic_exchange_explicit(&ring->middle, ring->front, memory_order_acq_rel);
+  ring->front = old & ~RING_FRESH;
+
+  const Frame *frame = &ring->frames[ring->front];
+  *skipped += frame->seq - ring->taken - 1;
+  ring->taken = frame->seq;
+  return frame;
+}
+
+void *render_thread(void *arg) {
+
+  RenderArgs *args = arg;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  while (1) {
+    // doneを先に読むことで、終了後に最後のフレームを取りこぼさない
+    int done = atomic_load_explicit(&args->ring->done, memory_order_acquire);
+
+    const Frame *frame = ring_latest(args->ring, &args->skipped);
+    if (frame != NULL) {
+      if (args->line > 0) printf("\e[%dA", args->line); // カーソルを表示した分だけ上に戻す
+
+      // 表示の座標系は width/2, height/2 のピクセル位置が原点となるようにする
+      // ただし、月は地球を中心として、別スケールで描画する
+      args->line = my_plot_objects(frame->objs, frame->numobj, frame->t, frame->view, args->cond);
+      if (args->initial.kinetic > 0) {
+        print_conservation(&args->initial, &frame->diag);
+        args->line++;
+      }
+      fflush(stdout);
+      args->rendered++;
+    }
+
+    if (done) break;
+
+    // 表示に時間がかかっても間隔がずれないように、絶対時刻で次の表示まで待つ
+    timespec_add_ns(&deadline, 1000L * 1000 * 1000 / REFRESH_RATE);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+  }
+
+  return NULL;
+}
+
+int my_plot_objects(const Object objs[], const size_t numobj, const double t, const View view, const Condition cond) {
 
   int line = 0;
 
@@ -145,18 +522,30 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
     }
   }
 
+  // 画面の中心
+  double cy = view.cy, cx = view.cx;
+  if (view.follow >= 0 && view.follow < numobj) {
+    cy += objs[view.follow].y;
+    cx += objs[view.follow].x;
+  }
+
+  // 1マスの大きさと、画面に入る範囲(中心からの距離)
+  const double cell_y = cond.au * view.scale, cell_x = cond.au * view.scale / 2;
+  const double half_y = (cond.height/2 + 1) * cell_y, half_x = (cond.width/2 + 1) * cell_x;
+
   // 物体
   if (cond.moon) {
     int y[3], x[3];
 
     for (int i=0; i<2; i++) {
-      y[i] = objs[i].y / (cond.au * 0.1) + cond.height/2 + 1;
-      x[i] = objs[i].x / (cond.au * 0.1/2) + cond.width/2 + 1;
+      y[i] = (objs[i].y - cy) / cell_y + cond.height/2 + 1;
+      x[i] = (objs[i].x - cx) / cell_x + cond.width/2 + 1;
     }
 
-    // 地球を中心としてスケールも変更
-    y[2] = (objs[2].y - objs[1].y) / (cond.earth_to_moon * 0.2) + y[1];
-    x[2] = (objs[2].x - objs[1].x) / (cond.earth_to_moon * 0.1) + x[1];
+    // 地球を中心としてスケールも変更(拡大・縮小は地球の周りにも同じ比率でかける)
+    double zoom = view.scale / cond.scale;
+    y[2] = (objs[2].y - objs[1].y) / (cond.earth_to_moon * 0.2 * zoom) + y[1];
+    x[2] = (objs[2].x - objs[1].x) / (cond.earth_to_moon * 0.1 * zoom) + x[1];
 
     for (int i=0; i<3; i++) {
       if (0 <= y[i] && y[i] < cond.height+2 && 0 <= x[i] && x[i] < cond.width+2) {
@@ -178,8 +567,12 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
   } else {
 
     for (int i=0; i<numobj; i++) {
-      int y = objs[i].y / (cond.au * cond.scale) + cond.height/2 + 1;
-      int x = objs[i].x / (cond.au * cond.scale/2) + cond.width/2 + 1;
+      // 表示範囲外の物体は座標変換せずに飛ばす
+      double dy = objs[i].y - cy, dx = objs[i].x - cx;
+      if (fabs(dy) > half_y || fabs(dx) > half_x) continue;
+
+      int y = dy / cell_y + cond.height/2 + 1;
+      int x = dx / cell_x + cond.width/2 + 1;
       if (0 <= y && y < cond.height+2 && 0 <= x && x < cond.width+2) {
         board[y][x] = 'o';
       }
@@ -213,7 +606,10 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
   line += cond.height + 2;
 
   //情報を表示
-  printf("t = %4.1lf days, numobj = %zu \r\n", t / 60 / 60 / 24, numobj);
+  printf("t = %4.1lf days, numobj = %zu, scale = %.3lg au, follow = %d %s\r\n",
+    t / 60 / 60 / 24, numobj, view.scale, view.follow, view.paused ? "(paused)" : "        ");
+  line++;
+  printf("keys: +/- zoom, hjkl/arrows pan, f follow, 0 reset, space pause, q quit\r\n");
   line++;
   for (int i=0; i<numobj; i++) {
     printf("%d: .y = %6.2lf .x = %6.2lf [au] .vy = %6.3lf vx = %6.3lf [au/day]\r\n",
@@ -226,7 +622,9 @@ int my_plot_objects(Object objs[], const size_t numobj, const double t, const Co
 }
 
 
-void my_update_velocities(Object objs[], const size_t numobj, const Condition cond) {
+void my_update_velocities(Object objs[], const size_t numobj, const Condition cond, double *potential) {
+
+  double u = 0;
 
   // 速度を更新
   for (int i=0; i<numobj; i++) {
@@ -236,19 +634,516 @@ void my_update_velocities(Object objs[], const size_t numobj, const Condition co
       double dist = distance(objs[i], objs[j], cond);
       objs[i].vy += cond.G * objs[j].m * (objs[j].y - objs[i].y) / pow(dist, 3) * cond.dt;
       objs[i].vx += cond.G * objs[j].m * (objs[j].x - objs[i].x) / pow(dist, 3) * cond.dt;
+
+      // 同じ組を2回数えるので半分ずつ足す
+      if (potential != NULL) u -= cond.G * objs[i].m * objs[j].m / dist / 2;
     }
   }
+
+  if (potential != NULL) *potential += u;
+}
+
+void measure_conserved(const Object objs[], const size_t numobj, Diagnostics *diag) {
+
+  diag->kinetic = diag->py = diag->px = diag->l = diag->p_abs = 0;
+
+  for (int i=0; i<numobj; i++) {
+    double v2 = objs[i].vy * objs[i].vy + objs[i].vx * objs[i].vx;
+    diag->kinetic += objs[i].m * v2 / 2;
+    diag->py += objs[i].m * objs[i].vy;
+    diag->px += objs[i].m * objs[i].vx;
+    diag->p_abs += objs[i].m * sqrt(v2);
+    diag->l += objs[i].m * (objs[i].x * objs[i].vy - objs[i].y * objs[i].vx);
+  }
+
+}
+
+void print_conservation(const Diagnostics *initial, const Diagnostics *now) {
+
+  double e0 = initial->kinetic + initial->potential;
+  double e = now->kinetic + now->potential;
+
+  // 運動量は全体で0に近いことが多いので、各物体の運動量の大きさの和で割る
+  printf("dE/E = %9.2le, dP/P = %9.2le, dL/L = %9.2le \r\n",
+    fabs((e - e0) / e0),
+    sqrt(pow(now->py - initial->py, 2) + pow(now->px - initial->px, 2)) / initial->p_abs,
+    fabs((now->l - initial->l) / initial->l));
 }
 
 
 void my_update_positions(Object objs[], const size_t numobj, const Condition cond) {
+  drift(objs, numobj, cond.dt);
+}
+
+void drift(Object objs[], const size_t numobj, const double h) {
 
   // 現在の位置をprev_yに保存してから更新する
   for (int i=0; i<numobj; i++) {
     objs[i].prev_y = objs[i].y;
-    objs[i].y += objs[i].vy * cond.dt;
+    objs[i].y += objs[i].vy * h;
     objs[i].prev_x = objs[i].x;
-    objs[i].x += objs[i].vx * cond.dt;
+    objs[i].x += objs[i].vx * h;
+  }
+
+}
+
+void compute_accelerations(const Object objs[], const size_t numobj, double ay[], double ax[], const Condition cond, double *potential) {
+
+  double u = 0;
+
+  for (int i=0; i<numobj; i++) {
+    ay[i] = ax[i] = 0;
+    for (int j=0; j<numobj; j++) {
+      if (i == j) continue;
+
+      double dist = distance(objs[i], objs[j], cond);
+      ay[i] += cond.G * objs[j].m * (objs[j].y - objs[i].y) / pow(dist, 3);
+      ax[i] += cond.G * objs[j].m * (objs[j].x - objs[i].x) / pow(dist, 3);
+
+      if (potential != NULL) u -= cond.G * objs[i].m * objs[j].m / dist / 2;
+    }
+  }
+
+  if (potential != NULL) *potential += u;
+}
+
+static const char *integrator_names[NUM_INTEGRATORS] = {"euler", "leapfrog", "rk4", "ias15"};
+
+int integrator_by_name(const char *name) {
+  for (int k=0; k<NUM_INTEGRATORS; k++) {
+    if (strcmp(name, integrator_names[k]) == 0) return k;
+  }
+  return -1;
+}
+
+Integrator create_integrator(const int method, const double tolerance) {
+  Integrator integ = {.method = method, .tolerance = tolerance, .dt = 0};
+  return integ;
+}
+
+void integrate_step(Object objs[], const size_t numobj, Integrator *integ, const Condition cond, double *potential) {
+
+  switch (integ->method) {
+
+    case INTEGRATOR_EULER:
+      // 位置を進めてから、新しい位置での力で速度を進める(シンプレクティック・オイラー法)
+      my_update_positions(objs, numobj, cond);
+      my_update_velocities(objs, numobj, cond, potential);
+      integ->evaluations++;
+      break;
+
+    case INTEGRATOR_LEAPFROG:
+      // 半分進めて、力で速度を進めて、残り半分進める(drift-kick-drift。力の計算は1回)
+      // (ポテンシャルは途中の位置ではなく、ステップの終わりの位置で後から求める)
+      drift(objs, numobj, cond.dt / 2);
+      my_update_velocities(objs, numobj, cond, NULL);
+      drift(objs, numobj, cond.dt / 2);
+      integ->evaluations++;
+      break;
+
+    case INTEGRATOR_RK4: {
+      // 4次のルンゲ・クッタ法(力の計算は4回)
+      double ay[4][MAX_OBJECTS], ax[4][MAX_OBJECTS]; // 各段の加速度
+      double vy[4][MAX_OBJECTS], vx[4][MAX_OBJECTS]; // 各段の速度
+      const double h = cond.dt;
+      const double weight[4] = {0, 0.5, 0.5, 1}; // 各段を評価する位置
+      Object stage[MAX_OBJECTS];
+
+      for (int k=0; k<4; k++) {
+        memcpy(stage, objs, sizeof(Object) * numobj);
+        for (int i=0; i<numobj; i++) {
+          if (k > 0) {
+            stage[i].y += vy[k-1][i] * h * weight[k];
+            stage[i].x += vx[k-1][i] * h * weight[k];
+            stage[i].vy += ay[k-1][i] * h * weight[k];
+            stage[i].vx += ax[k-1][i] * h * weight[k];
+          }
+          vy[k][i] = stage[i].vy;
+          vx[k][i] = stage[i].vx;
+        }
+        compute_accelerations(stage, numobj, ay[k], ax[k], cond, NULL);
+      }
+      integ->evaluations += 4;
+
+      for (int i=0; i<numobj; i++) {
+        objs[i].prev_y = objs[i].y;
+        objs[i].prev_x = objs[i].x;
+        objs[i].y += h / 6 * (vy[0][i] + 2 * vy[1][i] + 2 * vy[2][i] + vy[3][i]);
+        objs[i].x += h / 6 * (vx[0][i] + 2 * vx[1][i] + 2 * vx[2][i] + vx[3][i]);
+        objs[i].vy += h / 6 * (ay[0][i] + 2 * ay[1][i] + 2 * ay[2][i] + ay[3][i]);
+        objs[i].vx += h / 6 * (ax[0][i] + 2 * ax[1][i] + 2 * ax[2][i] + ax[3][i]);
+      }
+      integ->steps++;
+      break;
+    }
+
+    case INTEGRATOR_IAS15: {
+      // cond.dt は表示や記録の間隔として使い、その中の刻み幅は誤差から決める
+      // 最後のステップは cond.dt ちょうどで終わるように縮める
+      double y0[MAX_OBJECTS], x0[MAX_OBJECTS];
+      for (int i=0; i<numobj; i++) {
+        y0[i] = objs[i].y;
+        x0[i] = objs[i].x;
+      }
+      if (integ->dt <= 0) integ->dt = cond.dt;
+
+      double done = 0;
+      int finished = 0;
+      while (!finished) {
+        const double next = integ->dt;
+        const int clipped = next >= cond.dt - done;
+        const double want = clipped ? cond.dt - done : next;
+        const double h = radau_step(objs, numobj, integ, want, cond);
+        done += h;
+
+        if (clipped && h == want) {
+          // 縮めたステップから決めた刻み幅は縮めた分だけ小さいので、その分(next / want)だけ戻して予測を伸ばす
+          // (誤差からさらに小さい刻み幅が必要と分かったときは、その縮小はそのまま残す。元の刻み幅よりは伸ばさない)
+          const double restored = fmin(next, integ->dt * (next / want));
+          if (restored > integ->dt) {
+            for (int k=0; k<RADAU_NODES-1; k++) {
+              const double scale = pow(restored / integ->dt, k + 1);
+              for (int d=0; d<2; d++) {
+                for (int i=0; i<numobj; i++) integ->b[k][d][i] *= scale;
+              }
+            }
+            integ->dt = restored;
+          }
+          finished = 1;
+        }
+      }
+
+      for (int i=0; i<numobj; i++) {
+        objs[i].prev_y = y0[i];
+        objs[i].prev_x = x0[i];
+      }
+      break;
+    }
+  }
+
+  // 保存量を調べるときは、運動エネルギー(終わりの速度)と同じ時刻の、ステップの終わりの位置でポテンシャルを求める
+  // (オイラー法は位置を進めた後に力を計算しているので、そのときに求めてある)
+  if (potential != NULL && integ->method != INTEGRATOR_EULER) {
+    double ay[MAX_OBJECTS], ax[MAX_OBJECTS];
+    compute_accelerations(objs, numobj, ay, ax, cond, potential);
+    integ->evaluations++;
+  }
+
+  if (integ->method != INTEGRATOR_IAS15 && integ->method != INTEGRATOR_RK4) integ->steps++;
+
+}
+
+// ガウス・ラダウ法の分点(1ステップを0から1としたときの位置)
+static const double radau_h[RADAU_NODES] = {
+  0.0, 0.0562625605369221464656521910318, 0.180240691736892364987579942780, 0.352624717113169637373907769648,
+  0.547153626330555383001448554766, 0.734210177215410531523210605558, 0.885320946839095768090359771030,
+  0.977520613561287501891174488626
+};
+
+// 加速度を a0 + Σ g[j] t (t-h1)...(t-hj) と表したときの g から、a0 + Σ b[k] t^(k+1) の b への変換
+// t (t-h1)...(t-hj) を展開した t^(k+1) の係数を c[j][k] とすると b[k] = Σ_j c[j][k] g[j]
+static void radau_coefficients(double c[RADAU_NODES-1][RADAU_NODES-1]) {
+  memset(c, 0, sizeof(double) * (RADAU_NODES-1) * (RADAU_NODES-1));
+  c[0][0] = 1;
+  for (int j=1; j<RADAU_NODES-1; j++) {
+    // 1つ前の多項式に (t - h[j]) を掛ける
+    for (int k=0; k<=j; k++) {
+      c[j][k] = (k > 0 ? c[j-1][k-1] : 0) - radau_h[j] * (k < j ? c[j-1][k] : 0);
+    }
+  }
+}
+
+double radau_step(Object objs[], const size_t numobj, Integrator *integ, const double dt, const Condition cond) {
+
+  const int nb = RADAU_NODES - 1;
+  static double c[RADAU_NODES-1][RADAU_NODES-1];
+  static int initialized = 0;
+  if (!initialized) {
+    radau_coefficients(c);
+    initialized = 1;
+  }
+
+  // 始点の位置、速度、加速度
+  double q0[2][MAX_OBJECTS], v0[2][MAX_OBJECTS], a0[2][MAX_OBJECTS];
+  for (int i=0; i<numobj; i++) {
+    q0[0][i] = objs[i].y;
+    q0[1][i] = objs[i].x;
+    v0[0][i] = objs[i].vy;
+    v0[1][i] = objs[i].vx;
+  }
+  compute_accelerations(objs, numobj, a0[0], a0[1], cond, NULL);
+  integ->evaluations++;
+
+  // b は integ->dt の長さのステップ用に予測してあるので、実際の刻み幅に合わせて時間の単位を変える
+  if (integ->dt > 0 && dt != integ->dt) {
+    for (int k=0; k<nb; k++) {
+      const double scale = pow(dt / integ->dt, k + 1);
+      for (int d=0; d<2; d++) {
+        for (int i=0; i<numobj; i++) integ->b[k][d][i] *= scale;
+      }
+    }
+  }
+
+  double h = dt;
+  double g[RADAU_NODES-1][2][MAX_OBJECTS];
+  double at[2][MAX_OBJECTS];
+  Object stage[MAX_OBJECTS];
+  memcpy(stage, objs, sizeof(Object) * numobj);
+
+  while (1) {
+
+    // 予測した b から g を求める(c は対角が1の三角行列なので後ろから解ける)
+    for (int d=0; d<2; d++) {
+      for (int i=0; i<numobj; i++) {
+        for (int j=nb-1; j>=0; j--) {
+          double sum = integ->b[j][d][i];
+          for (int k=j+1; k<nb; k++) sum -= c[k][j] * g[k][d][i];
+          g[j][d][i] = sum;
+        }
+      }
+    }
+
+    // 予測子・修正子法: 各分点での加速度から g と b を更新し、b が変わらなくなるまで繰り返す
+    double last_error = INFINITY;
+    for (int iteration=0; iteration<RADAU_MAX_ITERATIONS; iteration++) {
+      double max_change = 0, max_acc = 0;
+
+      for (int n=1; n<RADAU_NODES; n++) {
+        const double s = radau_h[n];
+
+        // 分点 s での位置を今の b から求める
+        for (int d=0; d<2; d++) {
+          for (int i=0; i<numobj; i++) {
+            double sum = a0[d][i] / 2;
+            double power = s;
+            for (int k=0; k<nb; k++) {
+              sum += integ->b[k][d][i] * power / ((k + 2) * (k + 3));
+              power *= s;
+            }
+            const double q = q0[d][i] + v0[d][i] * h * s + h * h * s * s * sum;
+            if (d == 0) stage[i].y = q; else stage[i].x = q;
+          }
+        }
+        compute_accelerations(stage, numobj, at[0], at[1], cond, NULL);
+        integ->evaluations++;
+
+        // 差分商で g[n-1] を求め、変わった分だけ b を直す
+        for (int d=0; d<2; d++) {
+          for (int i=0; i<numobj; i++) {
+            double tmp = (at[d][i] - a0[d][i]) / s;
+            for (int k=0; k<n-1; k++) tmp = (tmp - g[k][d][i]) / (s - radau_h[k+1]);
+            const double change = tmp - g[n-1][d][i];
+            g[n-1][d][i] = tmp;
+            for (int k=0; k<n; k++) integ->b[k][d][i] += c[n-1][k] * change;
+
+            if (n == RADAU_NODES - 1) {
+              max_change = fmax(max_change, fabs(change));
+              max_acc = fmax(max_acc, fabs(at[d][i]));
+            }
+          }
+        }
+      }
+
+      // 最高次の係数の変化が丸め誤差程度になるか、減らなくなったら収束とみなす
+      const double error = max_acc > 0 ? max_change / max_acc : 0;
+      if (error < 1e-16 || (iteration > 1 && error >= last_error)) break;
+      last_error = error;
+    }
+
+    // 終点での加速度とその1階・2階微分から各物体の変化の時間スケールを求め、最も短いものに合わせて刻み幅を決める
+    // (最高次の係数だけで誤差を見積もると、刻み幅が小さいときに丸め誤差に埋もれて刻み幅が縮み続けてしまう)
+    double min_timescale2 = INFINITY;
+    for (int i=0; i<numobj; i++) {
+      double y2 = 0, y3 = 0, y4 = 0;
+      for (int d=0; d<2; d++) {
+        double acc = a0[d][i], jerk = 0, snap = 0;
+        for (int k=0; k<nb; k++) {
+          acc += integ->b[k][d][i];
+          jerk += (k + 1) * integ->b[k][d][i];
+          snap += (k + 1) * k * integ->b[k][d][i];
+        }
+        y2 += acc * acc;
+        y3 += jerk * jerk;
+        y4 += snap * snap;
+      }
+      const double timescale2 = 2 * y2 / (y3 + sqrt(y4 * y2));
+      if (isnormal(y2) && isnormal(timescale2) && timescale2 < min_timescale2) min_timescale2 = timescale2;
+    }
+    double next;
+    if (isnormal(min_timescale2)) {
+      next = h * sqrt(min_timescale2) * pow(integ->tolerance * 5040, 1.0 / 7); // 5040 = 7!
+    } else {
+      next = h / RADAU_SAFETY;
+    }
+
+    if (next < h * RADAU_SAFETY) {
+      // 誤差が大きすぎるのでやり直す。多項式はそのままで時間の単位だけ変える
+      const double ratio = next / h;
+      for (int k=0; k<nb; k++) {
+        const double scale = pow(ratio, k + 1);
+        for (int d=0; d<2; d++) {
+          for (int i=0; i<numobj; i++) integ->b[k][d][i] *= scale;
+        }
+      }
+      h = next;
+      integ->rejected++;
+      continue;
+    }
+    if (next > h / RADAU_SAFETY) next = h / RADAU_SAFETY;
+
+    // ステップの終点(s = 1)まで進める
+    for (int d=0; d<2; d++) {
+      for (int i=0; i<numobj; i++) {
+        double qsum = a0[d][i] / 2, vsum = a0[d][i];
+        for (int k=0; k<nb; k++) {
+          qsum += integ->b[k][d][i] / ((k + 2) * (k + 3));
+          vsum += integ->b[k][d][i] / (k + 2);
+        }
+        const double q = q0[d][i] + v0[d][i] * h + h * h * qsum;
+        const double v = v0[d][i] + h * vsum;
+        if (d == 0) {
+          objs[i].y = q;
+          objs[i].vy = v;
+        } else {
+          objs[i].x = q;
+          objs[i].vx = v;
+        }
+      }
+    }
+
+    // 次のステップの b を、今のステップの多項式を終点から先へ延ばして予測する
+    // a(1 + r s) を s で展開すると、s^(k+1) の係数は r^(k+1) Σ_{j>=k} C(j+1, k+1) b[j]
+    const double ratio = next / h;
+    for (int d=0; d<2; d++) {
+      for (int i=0; i<numobj; i++) {
+        double predicted[RADAU_NODES-1];
+        for (int k=0; k<nb; k++) {
+          double sum = 0, binomial = 1; // C(k+1, k+1) から始める
+          for (int j=k; j<nb; j++) {
+            sum += binomial * integ->b[j][d][i];
+            binomial = binomial * (j + 2) / (j + 1 - k);
+          }
+          predicted[k] = pow(ratio, k + 1) * sum;
+        }
+        for (int k=0; k<nb; k++) integ->b[k][d][i] = predicted[k];
+      }
+    }
+
+    integ->dt = next;
+    integ->steps++;
+    return h;
+  }
+
+}
+
+Condition condition_with_dt(const Condition cond, const double dt, const double moon) {
+  return (Condition) {
+    .width = cond.width, .height = cond.height, .G = cond.G, .dt = dt,
+    .au = cond.au, .earth_to_moon = cond.earth_to_moon, .scale = cond.scale, .moon = moon
+  };
+}
+
+double total_energy(const Object objs[], const size_t numobj, const Condition cond) {
+  double ay[MAX_OBJECTS], ax[MAX_OBJECTS];
+  Diagnostics diag = {0};
+  compute_accelerations(objs, numobj, ay, ax, cond, &diag.potential);
+  measure_conserved(objs, numobj, &diag);
+  return diag.kinetic + diag.potential;
+}
+
+BenchmarkResult run_scenario(const Scenario *sc, const char *filename, const int integrator, const int divisions, const double tolerance, const Condition base) {
+
+  const double period = sc->days * 60 * 60 * 24;
+  // ias15 は1周期を1回の呼び出しで進め、刻み幅は中で決める
+  const int calls = integrator == INTEGRATOR_IAS15 ? 1 : divisions;
+  const Condition cond = condition_with_dt(base, period / calls, sc->moon);
+
+  Object objs[MAX_OBJECTS];
+  size_t numobj;
+  load_objects(objs, &numobj, sc->moon ? "moon" : (char *)filename, cond);
+  Integrator integ = create_integrator(integrator, tolerance);
+
+  // 公転の中心(太陽か地球)から見た位置で比べる
+  const int c = sc->center;
+  const double y0 = objs[sc->body].y - objs[c].y, x0 = objs[sc->body].x - objs[c].x;
+  const double e0 = total_energy(objs, numobj, cond);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i=0; i<calls; i++) {
+    integrate_step(objs, numobj, &integ, cond, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  BenchmarkResult r = {
+    .integrator = integrator,
+    .tolerance = tolerance,
+    .dt = period / integ.steps,
+    .steps = integ.steps,
+    .evaluations = integ.evaluations,
+    .seconds = timespec_diff(&end, &start),
+    .energy_error = fabs((total_energy(objs, numobj, cond) - e0) / e0),
+    .y = objs[sc->body].y - objs[c].y,
+    .x = objs[sc->body].x - objs[c].x,
+  };
+  r.return_error = sqrt(pow(r.y - y0, 2) + pow(r.x - x0, 2)) / sqrt(y0 * y0 + x0 * x0);
+
+  return r;
+}
+
+void run_benchmark(const char *filename, const Condition base) {
+
+  // my_bouncing4.c の先頭の実行例と同じ公転周期[日]
+  const Scenario scenarios[] = {
+    {"Mercury", 0, 1, 0, 87.97}, {"Venus", 0, 2, 0, 224.70}, {"Earth", 0, 3, 0, 365},
+    {"Mars", 0, 4, 0, 686.98}, {"Jupiter", 0, 5, 0, 4329}, {"Saturn", 0, 6, 0, 10779},
+    {"Uranus", 0, 7, 0, 30752}, {"Neptune", 0, 8, 0, 60148}, {"Moon", 1, 2, 1, 27.3},
+  };
+  const int divisions[] = {100, 300, 1000, 3000, 10000}; // 1周期を何ステップに分けるか
+  const double tolerances[] = {1e-3, 1e-5, 1e-7, 1e-9, 1e-11}; // ias15 の許容誤差
+  const int reference_divisions = 30000; // 基準はrk4でこれだけ細かく分けたもの
+  const int nscenario = sizeof(scenarios) / sizeof(scenarios[0]);
+  const int ndiv = sizeof(divisions) / sizeof(divisions[0]);
+  const int ntol = sizeof(tolerances) / sizeof(tolerances[0]);
+
+  printf("%-8s %-9s %8s %10s %7s %7s %10s %10s %10s %10s %s\r\n",
+    "scenario", "method", "tol", "dt[days]", "steps", "evals", "time[ms]", "dE/E", "return", "vs ref", "pareto");
+
+  for (int s=0; s<nscenario; s++) {
+    const Scenario *sc = &scenarios[s];
+    BenchmarkResult ref = run_scenario(sc, filename, INTEGRATOR_RK4, reference_divisions, 0, base);
+    const double r0 = sqrt(ref.y * ref.y + ref.x * ref.x);
+
+    BenchmarkResult results[(NUM_INTEGRATORS - 1) * ndiv + ntol];
+    int n = 0;
+    for (int k=0; k<NUM_INTEGRATORS; k++) {
+      const int count = k == INTEGRATOR_IAS15 ? ntol : ndiv;
+      for (int d=0; d<count; d++) {
+        if (k == INTEGRATOR_IAS15) {
+          results[n] = run_scenario(sc, filename, k, 0, tolerances[d], base);
+        } else {
+          results[n] = run_scenario(sc, filename, k, divisions[d], 0, base);
+        }
+        results[n].reference_error = sqrt(pow(results[n].y - ref.y, 2) + pow(results[n].x - ref.x, 2)) / r0;
+        n++;
+      }
+    }
+
+    // 時間と基準からの誤差の両方で、他のどれにも負けていないものがパレート最適
+    for (int a=0; a<n; a++) {
+      int dominated = 0;
+      for (int b=0; b<n && !dominated; b++) {
+        dominated = results[b].seconds <= results[a].seconds && results[b].reference_error <= results[a].reference_error
+          && (results[b].seconds < results[a].seconds || results[b].reference_error < results[a].reference_error);
+      }
+      char tol[16] = "-";
+      if (results[a].integrator == INTEGRATOR_IAS15) snprintf(tol, sizeof(tol), "%.0le", results[a].tolerance);
+      printf("%-8s %-9s %8s %10.4lf %7zu %7zu %10.3lf %10.2le %10.2le %10.2le %s\r\n",
+        sc->name, integrator_names[results[a].integrator], tol, results[a].dt / (60 * 60 * 24), results[a].steps,
+        results[a].evaluations, results[a].seconds * 1000, results[a].energy_error, results[a].return_error,
+        results[a].reference_error, dominated ? "" : "*");
+    }
+    printf("\r\n");
   }
 
 }
@@ -322,4 +1217,1028 @@ int in_screen(double y, double x, const Condition cond) {
 
 int is_monotonic(double a, double b, double c) {
   return (a <= b && b <= c) || (c <= b && b <= a);
+}
+
+static struct termios saved_termios;
+static volatile sig_atomic_t raw_input = 0;
+
+// Ctrl-CやSIGTERMで終了したときも端末の設定を戻してから、元の動作(終了)をさせる
+// (SA_RESETHANDで既定の動作に戻してあるので、raiseすればそのまま終了する。tcsetattrはハンドラから呼んでよい)
+static void restore_input_on_signal(int sig) {
+  if (raw_input) tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+  raw_input = 0;
+  raise(sig);
+}
+
+void enable_raw_input(void) {
+
+  if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_termios) != 0) return;
+
+  // 行単位のバッファリングとエコーをやめ、VMIN=0, VTIME=0でreadが待たずに返るようにする
+  // (O_NONBLOCKは標準出力と共有している端末のファイル記述に付くので、表示の書き込みがEAGAINで失敗することがある。使わない)
+  struct termios raw = saved_termios;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+  raw_input = 1;
+  atexit(restore_input);
+
+  struct sigaction sa = {.sa_handler = restore_input_on_signal, .sa_flags = SA_RESETHAND};
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+void restore_input(void) {
+  if (!raw_input) return;
+  tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+  raw_input = 0;
+}
+
+int poll_keys(View *view, Playback *playback, const size_t numobj, const Condition cond) {
+
+  if (!raw_input) return 1;
+
+  const double step = 5; // 1回の移動量[マス]
+  unsigned char c;
+
+  while (read(STDIN_FILENO, &c, 1) == 1) {
+
+    // 矢印キーは ESC [ A〜D で送られてくるので hjkl に読み替える
+    if (c == '\e') {
+      unsigned char seq[2];
+      if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1 || seq[0] != '[') continue;
+      switch (seq[1]) {
+        case 'A': c = 'k'; break;
+        case 'B': c = 'j'; break;
+        case 'C': c = 'l'; break;
+        case 'D': c = 'h'; break;
+        default: continue;
+      }
+    }
+
+    switch (c) {
+      case '+':
+      case '=':
+        view->scale /= 1.5;
+        break;
+      case '-':
+        view->scale *= 1.5;
+        break;
+      case 'h':
+        view->cx -= step * cond.au * view->scale / 2;
+        break;
+      case 'l':
+        view->cx += step * cond.au * view->scale / 2;
+        break;
+      case 'k':
+        view->cy -= step * cond.au * view->scale;
+        break;
+      case 'j':
+        view->cy += step * cond.au * view->scale;
+        break;
+      case 'f':
+        // 追従なし -> 0 -> 1 -> ... -> numobj-1 -> 追従なし の順に切り替える
+        view->follow = (view->follow + 2) % ((int)numobj + 1) - 1;
+        view->cy = view->cx = 0;
+        break;
+      case '0':
+        *view = (View) {.scale = cond.scale, .cy = 0, .cx = 0, .follow = -1, .paused = view->paused};
+        break;
+      case ' ':
+      case 'p':
+        view->paused = !view->paused;
+        break;
+      case 'q':
+        return 0;
+    }
+
+    // 再生中だけ使うキー
+    if (playback == NULL) continue;
+    switch (c) {
+      case '<':
+        playback->speed /= 2;
+        break;
+      case '>':
+        playback->speed *= 2;
+        break;
+      case 'r':
+        playback->direction = -playback->direction;
+        break;
+      case '[':
+        playback->jump -= playback->speed * 60 * 60 * 24 * 5; // 再生速度で5秒分戻る
+        break;
+      case ']':
+        playback->jump += playback->speed * 60 * 60 * 24 * 5;
+        break;
+      case 'g':
+        playback->jump = -INFINITY; // 先頭へ
+        break;
+      case 'G':
+        playback->jump = INFINITY; // 末尾へ
+        break;
+    }
+  }
+
+  return 1;
+}
+
+// 同じ名前の領域が残っているときに、公開していたプロセスが終了していれば(異常終了で消されずに残っていれば)1を返す
+static int published_state_stale(const char *name) {
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) return errno == ENOENT;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PublishedState)) {
+    close(fd);
+    return 1;
+  }
+  PublishedState *state = mmap(NULL, sizeof(PublishedState), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED) return 0;
+
+  // 形式が違う、終了の印がある、公開していたプロセスがもういない、のどれかなら使われていない
+  int stale = atomic_load_explicit(&state->magic, memory_order_acquire) != PUBLISH_MAGIC || state->version != PUBLISH_VERSION ||
+    atomic_load_explicit(&state->done, memory_order_relaxed) || (kill(state->pid, 0) != 0 && errno == ESRCH);
+  munmap(state, sizeof(PublishedState));
+  return stale;
+}
+
+PublishedState *create_published_state(const char *name) {
+
+  // 他のプロセスが公開中の領域を乗っ取らないように、新しく作れたときだけ使う
+  // (異常終了したプロセスの領域が残っているだけなら、消してから作り直す)
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0 && errno == EEXIST && published_state_stale(name)) {
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't create shared memory '%s'%s\r\n", name, errno == EEXIST ? " (another process is publishing it)" : "");
+    exit(-1);
+  }
+  if (ftruncate(fd, sizeof(PublishedState)) != 0) {
+    fprintf(stderr, "Couldn't create shared memory '%s'\r\n", name);
+    shm_unlink(name);
+    exit(-1);
+  }
+
+  PublishedState *state = mmap(NULL, sizeof(PublishedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map shared memory '%s'\r\n", name);
+    exit(-1);
+  }
+
+  // 読む側が初期化途中の領域を有効と見なさないように、他を書き直す前にmagicを消しておく
+  // (フェンスで、以降の書き込みがmagicを消すより先に見えないようにする)
+  atomic_store_explicit(&state->magic, 0, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  atomic_store_explicit(&state->seq, 0, memory_order_relaxed);
+  atomic_store_explicit(&state->done, 0, memory_order_relaxed);
+  state->numobj = 0;
+  state->version = PUBLISH_VERSION;
+  state->pid = getpid();
+  // magicは最後に書いて、読む側が初期化途中の領域を読まないようにする
+  atomic_store_explicit(&state->magic, PUBLISH_MAGIC, memory_order_release);
+
+  return state;
+}
+
+void publish_state(PublishedState *state, const Object objs[], const size_t numobj, const double t) {
+
+  uint64_t seq = atomic_load_explicit(&state->seq, memory_order_relaxed);
+
+  // 奇数にしてから書き込み、書き終えたら偶数に戻す
+  atomic_store_explicit(&state->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  state->t = t;
+  state->numobj = numobj;
+  memcpy(state->objs, objs, sizeof(Object) * numobj);
+
+  atomic_store_explicit(&state->seq, seq + 2, memory_order_release);
+}
+
+void destroy_published_state(PublishedState *state, const char *name) {
+  munmap(state, sizeof(PublishedState));
+  shm_unlink(name);
+}
+
+TrajectoryWriter *open_trajectory_writer(const char *filename, const Condition cond, const double pos_error, const double vel_error) {
+
+  TrajectoryWriter *w = calloc(1, sizeof(TrajectoryWriter));
+  w->fp = fopen(filename, "wb");
+  if (w->fp == NULL) {
+    fprintf(stderr, "Couldn't open '%s'\r\n", filename);
+    exit(-1);
+  }
+
+  w->header = (TrajectoryHeader) {
+    .magic = TRAJECTORY_MAGIC, .version = TRAJECTORY_VERSION,
+    .dt = cond.dt, .scale = cond.scale, .moon = cond.moon,
+    .codec = pos_error > 0 ? TRAJECTORY_COMPRESSED : TRAJECTORY_RAW,
+    .keyframe_interval = KEYFRAME_INTERVAL,
+    .pos_error = pos_error, .vel_error = vel_error
+  };
+  if (w->header.codec == TRAJECTORY_COMPRESSED && vel_error <= 0) {
+    fprintf(stderr, "Velocity error bound must be positive\r\n");
+    exit(-1);
+  }
+  w->codec.since_key = KEYFRAME_INTERVAL; // 最初のフレームは必ずキーフレームにする
+
+  // ヘッダは閉じるときに書き直す(それまではフレーム数0、表なしのまま)
+  fwrite(&w->header, sizeof(TrajectoryHeader), 1, w->fp);
+  w->offset = sizeof(TrajectoryHeader);
+
+  return w;
+}
+
+void write_trajectory_frame(TrajectoryWriter *w, const Object objs[], const size_t numobj, const double t) {
+
+  if (w->numframes == w->capacity) {
+    w->capacity = w->capacity == 0 ? 1024 : w->capacity * 2;
+    w->index = realloc(w->index, sizeof(uint64_t) * w->capacity);
+    if (w->index == NULL) {
+      fprintf(stderr, "Couldn't allocate trajectory index\r\n");
+      exit(-1);
+    }
+  }
+  w->index[w->numframes++] = w->offset;
+  w->raw_bytes += sizeof(TrajectoryFrame) + sizeof(Object) * numobj;
+
+  if (w->header.codec == TRAJECTORY_COMPRESSED) {
+    // 先頭にバイト数を付けておき、表がなくても辿れるようにする
+    static uint8_t buf[sizeof(uint16_t) + MAX_OBJECTS * 4 * (RICE_ESCAPE + 64 + 1) / 8 + 64];
+    size_t len = encode_trajectory_frame(&w->codec, &w->header, objs, numobj, t, buf + sizeof(uint16_t));
+    uint16_t len16 = len;
+    memcpy(buf, &len16, sizeof(uint16_t));
+    fwrite(buf, 1, sizeof(uint16_t) + len, w->fp);
+    w->offset += sizeof(uint16_t) + len;
+    return;
+  }
+
+  TrajectoryFrame frame = {.t = t, .numobj = numobj};
+  fwrite(&frame, sizeof(TrajectoryFrame), 1, w->fp);
+  fwrite(objs, sizeof(Object), numobj, w->fp);
+  w->offset += sizeof(TrajectoryFrame) + sizeof(Object) * numobj;
+}
+
+void close_trajectory_writer(TrajectoryWriter *w) {
+
+  // 最後にフレームの位置の表を書き、ヘッダに表の位置を書き込む
+  // (圧縮したフレームは長さがばらばらなので、表をuint64_tとして読めるように8バイト境界まで0で埋める)
+  static const char zeros[sizeof(uint64_t)] = {0};
+  const size_t pad = (sizeof(uint64_t) - w->offset % sizeof(uint64_t)) % sizeof(uint64_t);
+  fwrite(zeros, 1, pad, w->fp);
+  w->offset += pad;
+  w->header.numframes = w->numframes;
+  w->header.index_offset = w->offset;
+  fwrite(w->index, sizeof(uint64_t), w->numframes, w->fp);
+  fseek(w->fp, 0, SEEK_SET);
+  fwrite(&w->header, sizeof(TrajectoryHeader), 1, w->fp);
+
+  if (w->header.codec == TRAJECTORY_COMPRESSED) {
+    uint64_t total = w->offset + sizeof(uint64_t) * w->numframes;
+    uint64_t raw = sizeof(TrajectoryHeader) + w->raw_bytes + sizeof(uint64_t) * w->numframes;
+    printf("recorded %zu frames in %llu bytes (raw %llu bytes, %.1lfx smaller)\r\n",
+           w->numframes, (unsigned long long)total, (unsigned long long)raw, (double)raw / total);
+  }
+
+  fclose(w->fp);
+  free(w->index);
+  free(w);
+}
+
+// 上位ビットから詰めて書く
+typedef struct bit_writer
+{
+  uint8_t *data;
+  size_t len; // 書き終えたバイト数
+  uint64_t acc; // まだバイトにしていないビット
+  int nacc;
+} BitWriter;
+
+typedef struct bit_reader
+{
+  const uint8_t *data;
+  size_t len;
+  size_t pos;
+  uint64_t acc;
+  int nacc;
+} BitReader;
+
+static void put_bits(BitWriter *bw, const uint64_t v, int n) {
+  while (n > 0) {
+    int take = n > 32 ? 32 : n;
+    n -= take;
+    bw->acc = (bw->acc << take) | ((v >> n) & ((1ULL << take) - 1));
+    bw->nacc += take;
+    while (bw->nacc >= 8) {
+      bw->nacc -= 8;
+      bw->data[bw->len++] = bw->acc >> bw->nacc;
+    }
+  }
+}
+
+static void flush_bits(BitWriter *bw) {
+  if (bw->nacc > 0) bw->data[bw->len++] = bw->acc << (8 - bw->nacc);
+  bw->nacc = 0;
+}
+
+static uint64_t get_bits(BitReader *br, int n) {
+  uint64_t v = 0;
+  while (n > 0) {
+    if (br->nacc == 0) {
+      br->acc = br->pos < br->len ? br->data[br->pos++] : 0;
+      br->nacc = 8;
+    }
+    int take = n < br->nacc ? n : br->nacc;
+    v = (v << take) | ((br->acc >> (br->nacc - take)) & ((1u << take) - 1));
+    br->nacc -= take;
+    n -= take;
+  }
+  return v;
+}
+
+// 続く1の数(0で終わる)。バイト単位で読めるところはまとめて数える
+static int get_unary(BitReader *br) {
+  int q = 0;
+  while (q < RICE_ESCAPE) {
+    if (br->nacc == 0) {
+      br->acc = br->pos < br->len ? br->data[br->pos++] : 0;
+      br->nacc = 8;
+    }
+    uint8_t rest = (br->acc << (8 - br->nacc)) & 0xff; // 残りのビットを上に詰めたもの
+    int ones = __builtin_clz((~(uint32_t)rest << 24) | 0x800000);
+    if (q + ones >= RICE_ESCAPE) {
+      br->nacc -= RICE_ESCAPE - q;
+      return RICE_ESCAPE;
+    }
+    if (ones < br->nacc) {
+      br->nacc -= ones + 1;
+      return q + ones;
+    }
+    q += ones;
+    br->nacc = 0;
+  }
+  return q;
+}
+
+static uint64_t zigzag(const int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(const uint64_t u) {
+  return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+// これまでの残差の平均からライス符号のパラメータを決める(JPEG-LSと同じ考え方)
+static int rice_parameter(const TrajectoryCodec *codec, const size_t i, const int c) {
+  int k = 0;
+  while (k < 60 && (codec->count[i][c] << k) < codec->sum[i][c]) k++;
+  return k;
+}
+
+static void update_rice(TrajectoryCodec *codec, const size_t i, const int c, const uint64_t u) {
+  codec->sum[i][c] += u;
+  if (++codec->count[i][c] >= 32) {
+    codec->sum[i][c] >>= 1;
+    codec->count[i][c] >>= 1;
+  }
+}
+
+// 直前のフレームからの予測。キーフレームから離れるほど高い次数の外挿にする
+static int64_t predict(const TrajectoryCodec *codec, const size_t i, const int c) {
+  const int64_t q1 = codec->history[0][i][c], q2 = codec->history[1][i][c], q3 = codec->history[2][i][c];
+  if (codec->since_key >= 3) return 3 * q1 - 3 * q2 + q3;
+  if (codec->since_key == 2) return 2 * q1 - q2;
+  return q1;
+}
+
+// 量子化した値を予測の履歴に入れる
+static void push_history(TrajectoryCodec *codec, const int64_t q[][4], const size_t numobj) {
+  memmove(codec->history[1], codec->history[0], sizeof(codec->history[0]) * 2);
+  memcpy(codec->history[0], q, sizeof(int64_t) * 4 * numobj);
+}
+
+// キーフレームで予測と符号の状態を初期化する
+static void reset_codec(TrajectoryCodec *codec, const size_t numobj, const double t) {
+  codec->numobj = numobj;
+  codec->since_key = 0;
+  codec->t_key = t;
+  for (size_t i = 0; i < numobj; i++) {
+    for (int c = 0; c < 4; c++) {
+      codec->sum[i][c] = 1 << 8;
+      codec->count[i][c] = 1;
+    }
+  }
+}
+
+size_t encode_trajectory_frame(TrajectoryCodec *codec, const TrajectoryHeader *header, const Object objs[], const size_t numobj, const double t, uint8_t *buf) {
+
+  // 誤差の上限の2倍の幅で丸めれば、復元した値のずれは上限以内になる
+  const double pos_step = 2 * header->pos_error, vel_step = 2 * header->vel_error;
+  int64_t q[MAX_OBJECTS][4];
+  for (size_t i = 0; i < numobj; i++) {
+    q[i][0] = llround(objs[i].y / pos_step);
+    q[i][1] = llround(objs[i].x / pos_step);
+    q[i][2] = llround(objs[i].vy / vel_step);
+    q[i][3] = llround(objs[i].vx / vel_step);
+  }
+
+  BitWriter bw = {.data = buf};
+  int key = codec->numobj != numobj || codec->since_key + 1 >= header->keyframe_interval;
+  if (key) {
+    reset_codec(codec, numobj, t);
+    put_bits(&bw, 1, 1);
+    put_bits(&bw, numobj, 16);
+    uint64_t bits;
+    memcpy(&bits, &t, sizeof(double));
+    put_bits(&bw, bits, 64);
+    for (size_t i = 0; i < numobj; i++) {
+      codec->m[i] = objs[i].m;
+      memcpy(&bits, &objs[i].m, sizeof(double));
+      put_bits(&bw, bits, 64);
+      for (int c = 0; c < 4; c++) put_bits(&bw, q[i][c], 64);
+    }
+  } else {
+    codec->since_key++;
+    put_bits(&bw, 0, 1);
+    for (size_t i = 0; i < numobj; i++) {
+      for (int c = 0; c < 4; c++) {
+        uint64_t u = zigzag(q[i][c] - predict(codec, i, c));
+        int k = rice_parameter(codec, i, c);
+        uint64_t quotient = u >> k;
+        if (quotient < RICE_ESCAPE) {
+          put_bits(&bw, (1ULL << (quotient + 1)) - 2, quotient + 1); // quotient個の1と0
+          put_bits(&bw, u, k);
+        } else {
+          put_bits(&bw, (1ULL << RICE_ESCAPE) - 1, RICE_ESCAPE);
+          put_bits(&bw, u, 64);
+        }
+        update_rice(codec, i, c, u);
+      }
+    }
+  }
+  flush_bits(&bw);
+
+  push_history(codec, (const int64_t (*)[4])q, numobj);
+  return bw.len;
+}
+
+void decode_trajectory_frame(TrajectoryCodec *codec, const TrajectoryHeader *header, const uint8_t *data, const size_t len, TrajectoryFrame *frame) {
+
+  const double pos_step = 2 * header->pos_error, vel_step = 2 * header->vel_error;
+  BitReader br = {.data = data, .len = len};
+  int64_t q[MAX_OBJECTS][4];
+
+  int key = get_bits(&br, 1);
+  if (key) {
+    size_t numobj = get_bits(&br, 16);
+    if (numobj > MAX_OBJECTS) numobj = MAX_OBJECTS;
+    uint64_t bits = get_bits(&br, 64);
+    double t;
+    memcpy(&t, &bits, sizeof(double));
+    reset_codec(codec, numobj, t);
+    for (size_t i = 0; i < numobj; i++) {
+      bits = get_bits(&br, 64);
+      memcpy(&codec->m[i], &bits, sizeof(double));
+      for (int c = 0; c < 4; c++) q[i][c] = get_bits(&br, 64);
+    }
+  } else {
+    codec->since_key++;
+    for (size_t i = 0; i < codec->numobj; i++) {
+      for (int c = 0; c < 4; c++) {
+        int k = rice_parameter(codec, i, c);
+        uint64_t quotient = get_unary(&br);
+        uint64_t u = quotient < RICE_ESCAPE ? (quotient << k) | get_bits(&br, k) : get_bits(&br, 64);
+        q[i][c] = predict(codec, i, c) + unzigzag(u);
+        update_rice(codec, i, c, u);
+      }
+    }
+  }
+  push_history(codec, (const int64_t (*)[4])q, codec->numobj);
+
+  // 前の位置は1つ前に復元したフレームから取る(キーフレームでは今の位置)
+  const int continued = !key && frame->numobj == codec->numobj;
+  frame->t = codec->t_key + codec->since_key * header->dt;
+  frame->numobj = codec->numobj;
+  for (size_t i = 0; i < codec->numobj; i++) {
+    Object *o = &frame->objs[i];
+    double y = q[i][0] * pos_step, x = q[i][1] * pos_step;
+    o->prev_y = continued ? o->y : y;
+    o->prev_x = continued ? o->x : x;
+    o->m = codec->m[i];
+    o->y = y;
+    o->x = x;
+    o->vy = q[i][2] * vel_step;
+    o->vx = q[i][3] * vel_step;
+  }
+}
+
+void open_trajectory(Trajectory *traj, const char *filename) {
+
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < offsetof(TrajectoryHeader, codec)) {
+    fprintf(stderr, "Couldn't open '%s'\r\n", filename);
+    exit(-1);
+  }
+
+  traj->size = st.st_size;
+  traj->map = mmap(NULL, traj->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (traj->map == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map '%s'\r\n", filename);
+    exit(-1);
+  }
+
+  // バージョン1のヘッダはcodec以降がないので、足りない分は生のフレームとして補う
+  const TrajectoryHeader *header = traj->map;
+  if (header->magic != TRAJECTORY_MAGIC || header->version < 1 || header->version > TRAJECTORY_VERSION
+      || (header->version >= 2 && traj->size < sizeof(TrajectoryHeader))) {
+    fprintf(stderr, "'%s' is not a trajectory file\r\n", filename);
+    exit(-1);
+  }
+  if (header->version == 1) {
+    traj->data_offset = offsetof(TrajectoryHeader, codec);
+    memcpy(&traj->header, header, traj->data_offset);
+    traj->header.codec = TRAJECTORY_RAW;
+  } else {
+    traj->data_offset = sizeof(TrajectoryHeader);
+    traj->header = *header;
+  }
+  traj->codec = traj->header.codec;
+  traj->decoded = SIZE_MAX;
+  if (traj->codec == TRAJECTORY_COMPRESSED) {
+    traj->frame = malloc(sizeof(TrajectoryFrame) + sizeof(Object) * MAX_OBJECTS);
+    if (traj->frame == NULL) {
+      fprintf(stderr, "Couldn't allocate trajectory frame\r\n");
+      exit(-1);
+    }
+  }
+
+  // 表が8バイト境界にない古いファイルは、表を使わずに作り直す
+  if (traj->header.index_offset != 0 && traj->header.index_offset % sizeof(uint64_t) == 0 &&
+      traj->header.index_offset + sizeof(uint64_t) * traj->header.numframes <= traj->size) {
+    traj->numframes = traj->header.numframes;
+    traj->index = (const uint64_t *)((const char *)traj->map + traj->header.index_offset);
+  } else {
+    // 途中で止めたなどで表がない場合は、一度だけ先頭から辿って作る
+    uint64_t *index = NULL;
+    size_t capacity = 0;
+    uint64_t offset = traj->data_offset;
+    traj->numframes = 0;
+    while (1) {
+      uint64_t next;
+      if (traj->codec == TRAJECTORY_COMPRESSED) {
+        uint16_t len;
+        if (offset + sizeof(uint16_t) > traj->size) break;
+        memcpy(&len, (const char *)traj->map + offset, sizeof(uint16_t));
+        next = offset + sizeof(uint16_t) + len;
+        if (next > traj->size) break;
+      } else {
+        if (offset + sizeof(TrajectoryFrame) > traj->size) break;
+        const TrajectoryFrame *frame = (const TrajectoryFrame *)((const char *)traj->map + offset);
+        next = offset + sizeof(TrajectoryFrame) + sizeof(Object) * frame->numobj;
+        if (frame->numobj > MAX_OBJECTS || next > traj->size) break;
+      }
+
+      if (traj->numframes == capacity) {
+        capacity = capacity == 0 ? 1024 : capacity * 2;
+        index = realloc(index, sizeof(uint64_t) * capacity);
+        if (index == NULL) {
+          fprintf(stderr, "Couldn't allocate trajectory index\r\n");
+          exit(-1);
+        }
+      }
+      index[traj->numframes++] = offset;
+      offset = next;
+    }
+    traj->index = traj->owned_index = index;
+  }
+
+  if (traj->numframes > 0) traj->t_begin = trajectory_frame(traj, 0)->t;
+}
+
+// 圧縮したフレームがキーフレームかどうか(ビット列の最初の1ビット)
+static int is_keyframe(const Trajectory *traj, const size_t k) {
+  const uint8_t *p = (const uint8_t *)traj->map + traj->index[k] + sizeof(uint16_t);
+  return (*p & 0x80) != 0;
+}
+
+const TrajectoryFrame *trajectory_frame(Trajectory *traj, const size_t k) {
+
+  if (traj->codec != TRAJECTORY_COMPRESSED) {
+    return (const TrajectoryFrame *)((const char *)traj->map + traj->index[k]);
+  }
+  if (traj->decoded == k) return traj->frame;
+
+  // 直前のキーフレームを探し、それより後まで復元済みならその続きから、そうでなければキーフレームから復元する
+  size_t from = k;
+  while (from > 0 && !is_keyframe(traj, from)) from--;
+  if (traj->decoded != SIZE_MAX && traj->decoded >= from && traj->decoded < k) from = traj->decoded + 1;
+
+  for (size_t j = from; j <= k; j++) {
+    const uint8_t *p = (const uint8_t *)traj->map + traj->index[j];
+    uint16_t len;
+    memcpy(&len, p, sizeof(uint16_t));
+    decode_trajectory_frame(&traj->state, &traj->header, p + sizeof(uint16_t), len, traj->frame);
+  }
+  traj->decoded = k;
+  return traj->frame;
+}
+
+size_t trajectory_seek(const Trajectory *traj, const double t) {
+
+  // フレームは等間隔なので、時刻から直接フレーム番号が決まる
+  double k = floor((t - traj->t_begin) / traj->header.dt + 0.5);
+  if (k < 0) return 0;
+  if (k >= traj->numframes) return traj->numframes - 1;
+  return k;
+}
+
+void close_trajectory(Trajectory *traj) {
+  munmap(traj->map, traj->size);
+  free(traj->owned_index);
+  free(traj->frame);
+  *traj = (Trajectory) {0};
+}
+
+void replay_trajectory(Trajectory *traj, double speed, const Condition cond) {
+
+  if (traj->numframes == 0) {
+    fprintf(stderr, "No frames to replay\r\n");
+    return;
+  }
+
+  const double t_begin = trajectory_frame(traj, 0)->t;
+  const double t_end = trajectory_frame(traj, traj->numframes - 1)->t;
+
+  // 速さが指定されなければ全体を10秒で再生する
+  if (speed <= 0) speed = fmax((t_end - t_begin) / (60 * 60 * 24) / 10, 1e-3);
+
+  View view = {.scale = cond.scale, .cy = 0, .cx = 0, .follow = -1, .paused = 0};
+  Playback playback = {.speed = speed, .direction = 1, .jump = 0};
+
+  static FrameRing ring;
+  ring_init(&ring);
+  RenderArgs render_args = {.ring = &ring, .cond = cond, .line = 0};
+  const Diagnostics none = {0};
+
+  pthread_t render;
+  if (pthread_create(&render, NULL, render_thread, &render_args) != 0) {
+    fprintf(stderr, "Couldn't create render thread\r\n");
+    return;
+  }
+  enable_raw_input();
+
+  double t = t_begin;
+  size_t k = 0;
+  const TrajectoryFrame *frame = trajectory_frame(traj, k);
+  ring_push(&ring, frame->objs, frame->numobj, frame->t, view, none);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  while (1) {
+
+    if (!poll_keys(&view, &playback, frame->numobj, cond)) break;
+
+    // 再生位置を進めて、その時刻のフレームを表から直接求める
+    if (!view.paused) t += playback.direction * playback.speed * 60 * 60 * 24 / REFRESH_RATE;
+    t = fmin(fmax(t + playback.jump, t_begin), t_end);
+    playback.jump = 0;
+
+    k = trajectory_seek(traj, t);
+    frame = trajectory_frame(traj, k);
+    ring_push(&ring, frame->objs, frame->numobj, frame->t, view, none);
+
+    // 端まで再生したら終わる
+    if ((playback.direction > 0 && t >= t_end) || (playback.direction < 0 && t <= t_begin)) break;
+
+    timespec_add_ns(&deadline, 1000L * 1000 * 1000 / REFRESH_RATE);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+  }
+
+  ring_push(&ring, frame->objs, frame->numobj, frame->t, view, none);
+  atomic_store_explicit(&ring.done, 1, memory_order_release);
+  pthread_join(render, NULL);
+  restore_input();
+
+  printf("replayed %zu frames (%.1lf - %.1lf days)\r\n", traj->numframes, t_begin / 60 / 60 / 24, t_end / 60 / 60 / 24);
+}
+
+int parse_image_size(const char *text, int *width, int *height) {
+  int w, h;
+  if (sscanf(text, "%dx%d", &w, &h) != 2 || w < 1 || h < 1 || w > 16384 || h > 16384) return 0;
+  *width = w;
+  *height = h;
+  return 1;
+}
+
+// 描画待ちのジョブを取り出して描き、空きに戻すのを繰り返す
+static void *image_worker(void *arg) {
+
+  ImageRenderer *r = arg;
+  unsigned char *rgb = malloc((size_t)r->options.width * r->options.height * 3);
+  if (rgb == NULL) {
+    fprintf(stderr, "Couldn't allocate image\r\n");
+    exit(-1);
+  }
+
+  while (1) {
+    pthread_mutex_lock(&r->lock);
+    while (r->nready == 0 && !r->done) pthread_cond_wait(&r->ready_cond, &r->lock);
+    if (r->nready == 0) {
+      pthread_mutex_unlock(&r->lock);
+      break;
+    }
+    int k = r->ready[r->ready_head];
+    r->ready_head = (r->ready_head + 1) % r->capacity;
+    r->nready--;
+    pthread_mutex_unlock(&r->lock);
+
+    rasterize_image(&r->jobs[k], rgb, &r->options);
+
+    pthread_mutex_lock(&r->lock);
+    r->free_list[r->nfree++] = k;
+    pthread_cond_signal(&r->free_cond);
+    pthread_mutex_unlock(&r->lock);
+  }
+
+  free(rgb);
+  return NULL;
+}
+
+void start_image_renderer(ImageRenderer *r, const ImageOptions options, const Condition cond) {
+
+  // Conditionのメンバはconstなので、代入ではなく初期化した値を写す
+  memcpy(r, &(ImageRenderer) {.options = options, .cond = cond}, sizeof(ImageRenderer));
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->ready_cond, NULL);
+  pthread_cond_init(&r->free_cond, NULL);
+
+  // 描いている間に次を用意できるように、スレッド数の2倍のジョブを用意する
+  const int history = options.trail + 1;
+  r->capacity = 2 * options.workers;
+  r->jobs = calloc(r->capacity, sizeof(ImageJob));
+  r->ready = malloc(sizeof(int) * r->capacity);
+  r->free_list = malloc(sizeof(int) * r->capacity);
+  r->threads = malloc(sizeof(pthread_t) * options.workers);
+  r->trail_y = malloc(sizeof(double) * history * MAX_OBJECTS);
+  r->trail_x = malloc(sizeof(double) * history * MAX_OBJECTS);
+  if (r->jobs == NULL || r->ready == NULL || r->free_list == NULL || r->threads == NULL || r->trail_y == NULL || r->trail_x == NULL) {
+    fprintf(stderr, "Couldn't allocate image renderer\r\n");
+    exit(-1);
+  }
+  for (int k=0; k<r->capacity; k++) {
+    r->jobs[k].py = malloc(sizeof(double) * history * MAX_OBJECTS);
+    r->jobs[k].px = malloc(sizeof(double) * history * MAX_OBJECTS);
+    if (r->jobs[k].py == NULL || r->jobs[k].px == NULL) {
+      fprintf(stderr, "Couldn't allocate image renderer\r\n");
+      exit(-1);
+    }
+    r->free_list[r->nfree++] = k;
+  }
+
+  for (int w=0; w<options.workers; w++) {
+    if (pthread_create(&r->threads[w], NULL, image_worker, r) != 0) {
+      fprintf(stderr, "Couldn't create image thread\r\n");
+      exit(-1);
+    }
+  }
+}
+
+void submit_image(ImageRenderer *r, const Object objs[], const size_t numobj) {
+
+  const ImageOptions *opt = &r->options;
+  const Condition cond = r->cond;
+  const int history = opt->trail + 1;
+
+  // 端末の表示と同じ範囲が画像の高さに収まるようにし、横は画像の縦横比に合わせて広げる
+  // (端末の1マスは縦長なので、画像では縦横とも同じ縮尺になる)
+  const double pixels_per_row = (double)opt->height / (cond.height + 2);
+  const double meters_per_pixel = cond.au * cond.scale / pixels_per_row;
+
+  // 位置をピクセルに直して軌跡のリングに入れる。月は地球を中心に別スケールで描く
+  r->trail_head = (r->trail_head + 1) % history;
+  if (r->trail_count < history) r->trail_count++;
+  double *ty = r->trail_y + r->trail_head * MAX_OBJECTS, *tx = r->trail_x + r->trail_head * MAX_OBJECTS;
+  for (size_t i=0; i<numobj; i++) {
+    ty[i] = opt->height / 2.0 + objs[i].y / meters_per_pixel;
+    tx[i] = opt->width / 2.0 + objs[i].x / meters_per_pixel;
+  }
+  if (cond.moon && numobj >= 3) {
+    ty[2] = ty[1] + (objs[2].y - objs[1].y) / (cond.earth_to_moon * 0.2) * pixels_per_row;
+    tx[2] = tx[1] + (objs[2].x - objs[1].x) / (cond.earth_to_moon * 0.2) * pixels_per_row;
+  }
+
+  // 点の大きさは一番軽い物体との質量比の対数に比例させる
+  double m_min = INFINITY;
+  for (size_t i=0; i<numobj; i++) {
+    if (objs[i].m > 0 && objs[i].m < m_min) m_min = objs[i].m;
+  }
+
+  struct timespec before, after;
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  pthread_mutex_lock(&r->lock);
+  while (r->nfree == 0) pthread_cond_wait(&r->free_cond, &r->lock);
+  int k = r->free_list[--r->nfree];
+  pthread_mutex_unlock(&r->lock);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  r->waited += timespec_diff(&after, &before);
+
+  // 空きのジョブは他のスレッドが触らないので、ロックの外で書く
+  ImageJob *job = &r->jobs[k];
+  job->number = r->submitted++;
+  job->numobj = numobj;
+  job->ntrail = r->trail_count;
+  for (size_t i=0; i<numobj; i++) {
+    job->radius[i] = fmin(1.5 + 1.2 * log10(objs[i].m / m_min), opt->height / 30.0);
+  }
+  for (int s=0; s<job->ntrail; s++) {
+    const int slot = (r->trail_head - s + history) % history;
+    memcpy(job->py + s * MAX_OBJECTS, r->trail_y + slot * MAX_OBJECTS, sizeof(double) * numobj);
+    memcpy(job->px + s * MAX_OBJECTS, r->trail_x + slot * MAX_OBJECTS, sizeof(double) * numobj);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  r->ready[(r->ready_head + r->nready) % r->capacity] = k;
+  r->nready++;
+  pthread_cond_signal(&r->ready_cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+void finish_image_renderer(ImageRenderer *r) {
+
+  pthread_mutex_lock(&r->lock);
+  r->done = 1;
+  pthread_cond_broadcast(&r->ready_cond);
+  pthread_mutex_unlock(&r->lock);
+  for (int w=0; w<r->options.workers; w++) {
+    pthread_join(r->threads[w], NULL);
+  }
+
+  for (int k=0; k<r->capacity; k++) {
+    free(r->jobs[k].py);
+    free(r->jobs[k].px);
+  }
+  free(r->jobs);
+  free(r->ready);
+  free(r->free_list);
+  free(r->threads);
+  free(r->trail_y);
+  free(r->trail_x);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->ready_cond);
+  pthread_cond_destroy(&r->free_cond);
+}
+
+// 物体ごとの色(番号順に繰り返す)
+static const unsigned char image_palette[][3] = {
+  {255, 220, 120}, {170, 170, 170}, {230, 200, 150}, {100, 160, 255},
+  {230, 110, 80}, {220, 170, 120}, {240, 220, 160}, {150, 220, 230}, {90, 120, 250}
+};
+
+// 色を明るさalphaで足し込む(255で飽和させる)
+static void add_pixel(unsigned char rgb[], const int width, const int height, const int y, const int x, const unsigned char color[3], const double alpha) {
+  if (y < 0 || y >= height || x < 0 || x >= width) return;
+  unsigned char *p = rgb + ((size_t)y * width + x) * 3;
+  for (int c=0; c<3; c++) {
+    int v = p[c] + (int)(color[c] * alpha);
+    p[c] = v > 255 ? 255 : v;
+  }
+}
+
+// 線分(y0,x0)-(y1,x1)のうち 0<=y<=height, 0<=x<=width に入る部分に端点を縮める(Liang-Barsky)
+// 入る部分がなければ0を返す。遠くへ飛んでいった物体の軌跡でも、縮めた後はピクセル座標の範囲に収まる
+static int clip_segment(double *y0, double *x0, double *y1, double *x1, const int height, const int width) {
+
+  if (!isfinite(*y0) || !isfinite(*x0) || !isfinite(*y1) || !isfinite(*x1)) return 0;
+
+  const double dy = *y1 - *y0, dx = *x1 - *x0;
+  // 各辺について、線分の向きに沿った成分pと、始点から辺までの余裕q (p * f <= q を満たすfが内側)
+  const double p[4] = {-dy, dy, -dx, dx};
+  const double q[4] = {*y0, height - *y0, *x0, width - *x0};
+  double f0 = 0, f1 = 1;
+  for (int k=0; k<4; k++) {
+    if (p[k] == 0) {
+      if (q[k] < 0) return 0; // 辺と平行で外側にある
+      continue;
+    }
+    const double f = q[k] / p[k];
+    if (p[k] < 0) {
+      if (f > f1) return 0;
+      if (f > f0) f0 = f;
+    } else {
+      if (f < f0) return 0;
+      if (f < f1) f1 = f;
+    }
+  }
+
+  *y1 = *y0 + dy * f1;
+  *x1 = *x0 + dx * f1;
+  *y0 = *y0 + dy * f0;
+  *x0 = *x0 + dx * f0;
+  return 1;
+}
+
+void rasterize_image(const ImageJob *job, unsigned char rgb[], const ImageOptions *options) {
+
+  const int width = options->width, height = options->height;
+  const int ncolors = sizeof(image_palette) / sizeof(image_palette[0]);
+  memset(rgb, 0, (size_t)width * height * 3);
+
+  // 軌跡は古いものほど暗くし、隣り合うサンプルの間を線分でつなぐ
+  for (size_t i=0; i<job->numobj; i++) {
+    const unsigned char *color = image_palette[i % ncolors];
+    for (int s=job->ntrail-1; s>=1; s--) {
+      double y0 = job->py[s * MAX_OBJECTS + i], x0 = job->px[s * MAX_OBJECTS + i];
+      double y1 = job->py[(s-1) * MAX_OBJECTS + i], x1 = job->px[(s-1) * MAX_OBJECTS + i];
+      const double alpha = 0.5 * (1 - (double)s / job->ntrail);
+
+      // 画像に入る部分だけに縮めてから、1ピクセルずつ進めて描く
+      if (!clip_segment(&y0, &x0, &y1, &x1, height, width)) continue;
+      const int n = fmax(fabs(y1 - y0), fabs(x1 - x0)) + 1;
+      for (int k=0; k<n; k++) {
+        const double f = (double)k / n;
+        add_pixel(rgb, width, height, floor(y0 + (y1 - y0) * f), floor(x0 + (x1 - x0) * f), color, alpha);
+      }
+    }
+  }
+
+  // 物体は質量で決めた半径の円で、軌跡の上に塗る
+  for (size_t i=0; i<job->numobj; i++) {
+    const unsigned char *color = image_palette[i % ncolors];
+    const double cy = job->py[i], cx = job->px[i], r = job->radius[i];
+    if (cy < -r || cy >= height + r || cx < -r || cx >= width + r) continue;
+    for (int y=floor(cy - r); y<=ceil(cy + r); y++) {
+      for (int x=floor(cx - r); x<=ceil(cx + r); x++) {
+        if (y < 0 || y >= height || x < 0 || x >= width) continue;
+        if (pow(y + 0.5 - cy, 2) + pow(x + 0.5 - cx, 2) > r * r) continue;
+        memcpy(rgb + ((size_t)y * width + x) * 3, color, 3);
+      }
+    }
+  }
+
+  char name[1024];
+  snprintf(name, sizeof(name), "%s%06zu.ppm", options->prefix, job->number);
+  FILE *fp = fopen(name, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Couldn't open '%s'\r\n", name);
+    exit(-1);
+  }
+  fprintf(fp, "P6\n%d %d\n255\n", width, height);
+  fwrite(rgb, 3, (size_t)width * height, fp);
+  fclose(fp);
+}
+
+void render_images(Object objs[], const size_t numobj, Integrator *integ, const double stop_time, const ImageOptions options, const Condition cond) {
+
+  ImageRenderer renderer;
+  start_image_renderer(&renderer, options, cond);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // 端末の表示のように締め切りに合わせず、できるだけ速く進めて描画のスレッドに渡す
+  double t = 0;
+  submit_image(&renderer, objs, numobj);
+  for (int i = 0 ; t < stop_time ; i++){
+    t = i * cond.dt;
+    integrate_step(objs, numobj, integ, cond, NULL);
+    if ((i + 1) % options.every == 0) submit_image(&renderer, objs, numobj);
+  }
+
+  finish_image_renderer(&renderer);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("wrote %zu images (%dx%d) with %d threads in %.2lf s, simulation waited %.2lf s for free slots\r\n",
+    renderer.submitted, options.width, options.height, options.workers, timespec_diff(&end, &start), renderer.waited);
+}
+
+void render_trajectory_images(Trajectory *traj, const ImageOptions options, const Condition cond) {
+
+  ImageRenderer renderer;
+  start_image_renderer(&renderer, options, cond);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // 圧縮した軌道は順に読むのが速いので、間引くフレームも順に復元する
+  for (size_t k=0; k<traj->numframes; k++) {
+    const TrajectoryFrame *frame = trajectory_frame(traj, k);
+    if (k % options.every == 0) submit_image(&renderer, frame->objs, frame->numobj);
+  }
+
+  finish_image_renderer(&renderer);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("wrote %zu images (%dx%d) with %d threads in %.2lf s, decoding waited %.2lf s for free slots\r\n",
+    renderer.submitted, options.width, options.height, options.workers, timespec_diff(&end, &start), renderer.waited);
 }
\ No newline at end of file
@@ -1,3 +1,21 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define MAX_OBJECTS 100 // 読み込める物体の最大数
+#define RING_FRESH 4 // FrameRingのmiddleに立てる、描画スレッドがまだ受け取っていないことを示すビット
+#define REFRESH_RATE 60 // 描画スレッドが1秒間に表示する回数
+#define PUBLISH_MAGIC 0x3442424d // 公開する共有メモリの先頭に書く値("MBB4")
+#define PUBLISH_VERSION 2
+#define TRAJECTORY_MAGIC 0x4a415254 // 軌道ファイルの先頭に書く値("TRAJ")
+#define TRAJECTORY_VERSION 2
+#define KEYFRAME_INTERVAL 64 // 圧縮した軌道でキーフレームを置く間隔
+#define RICE_ESCAPE 24 // ライス符号の商がこれ以上になる値はそのまま64ビットで書く
+#define MAX_TRAIL 1024 // 画像に描く軌跡の長さの上限(サンプル数)
+
 // シミュレーション条件を格納する構造体
 // 反発係数CORを追加
 typedef struct condition
@@ -21,10 +39,286 @@ typedef struct object
   double vy, vx;
 } Object;
 
-int my_plot_objects(Object objs[], const size_t numobj, const double t, const Condition cond);
-void my_update_velocities(Object objs[], const size_t numobj, const Condition cond);
+// 表示範囲(キー入力で変更する)
+typedef struct view
+{
+  double scale; // scale[au]を高さ1マス分とする
+  double cy, cx; // 画面の中心の座標(followしているときはその物体からのずれ)
+  int follow; // 画面の中心に追従する物体のインデックス(しないなら-1)
+  int paused; // 一時停止中なら1
+} View;
+
+// 再生の状態(キー入力で変更する)
+typedef struct playback
+{
+  double speed; // 再生の速さ[日/秒]
+  int direction; // 1なら順方向、-1なら逆方向
+  double jump; // 次のフレームで再生位置を動かす量[秒]
+} Playback;
+
+// 積分法
+enum { INTEGRATOR_EULER, INTEGRATOR_LEAPFROG, INTEGRATOR_RK4, INTEGRATOR_IAS15, NUM_INTEGRATORS };
+
+#define RADAU_NODES 8 // ガウス・ラダウ法の分点の数(始点を含む)
+#define RADAU_MAX_ITERATIONS 12 // 予測子・修正子の反復の上限
+#define RADAU_SAFETY 0.25 // 刻み幅を一度に変えてよい倍率
+
+// 積分法とその状態
+typedef struct integrator
+{
+  int method;
+  double tolerance; // ias15 の許容誤差
+  double dt; // ias15 が次に試す刻み幅[秒] (0なら cond.dt から始める)
+  double b[RADAU_NODES-1][2][MAX_OBJECTS]; // 1ステップ内の加速度を時間の多項式で表した係数(次のステップの予測)
+  size_t steps; // 実際に進めたステップ数
+  size_t evaluations; // 力を計算した回数
+  size_t rejected; // 誤差が大きくてやり直したステップ数
+} Integrator;
+
+// ベンチマークで計算する場面
+typedef struct scenario
+{
+  const char *name;
+  double moon; // 太陽、地球、月のモードなら1
+  int body; // 1周して戻ってくるかを調べる物体
+  int center; // 公転の中心の物体
+  double days; // 公転周期[日]
+} Scenario;
+
+// ベンチマークの1回分の結果
+typedef struct benchmark_result
+{
+  int integrator;
+  double tolerance;
+  double dt; // 平均の時間刻み幅
+  size_t steps;
+  size_t evaluations; // 力を計算した回数
+  double seconds; // 計算にかかった時間
+  double energy_error; // エネルギーの相対的なずれ
+  double return_error; // 1周後に元の位置からずれた距離(公転半径との比)
+  double reference_error; // 基準の計算からずれた距離(公転半径との比)
+  double y, x; // 1周後の中心から見た位置
+} BenchmarkResult;
+
+// 保存量
+typedef struct diagnostics
+{
+  double kinetic; // 運動エネルギー
+  double potential; // ポテンシャルエネルギー
+  double py, px; // 運動量
+  double p_abs; // 各物体の運動量の大きさの和(運動量のずれを比べる基準)
+  double l; // 角運動量
+} Diagnostics;
+
+// ある時刻の全物体の位置のスナップショット
+typedef struct frame
+{
+  double t;
+  size_t numobj;
+  View view;
+  Diagnostics diag; // 最後に計算した保存量
+  size_t seq; // ring_pushで書き込んだ通し番号(1から)
+  Object objs[MAX_OBJECTS];
+} Frame;
+
+// シミュレーションスレッドが書き込み、描画スレッドが読み出す最新のフレームの三重バッファ
+// 書き込み側(back)と読み出し側(front)がそれぞれ1枚ずつ持ち、残りの1枚(middle)と交換して受け渡すのでロックは不要
+// 書き込み側は待たずに常に書け、まだ読まれていないフレームは次のフレームで置き換わる
+typedef struct frame_ring
+{
+  Frame frames[3];
+  int back; // 書き込み側が次に書くフレーム
+  int front; // 読み出し側が表示しているフレーム
+  _Atomic int middle; // 受け渡し中のフレームの番号(RING_FRESHが立っていれば描画スレッドがまだ受け取っていない)
+  size_t pushed; // 書き込んだフレームの数(書き込み側だけが使う)
+  size_t taken; // 最後に受け取ったフレームの通し番号(読み出し側だけが使う)
+  _Atomic int done; // シミュレーションが終了したら1
+} FrameRing;
+
+// 外部のビューアに公開する状態(POSIX共有メモリに置く)
+// seqが奇数の間は書き込み中。読む側は読む前後でseqが同じ偶数であることを確かめる
+typedef struct published_state
+{
+  _Atomic uint32_t magic; // 初期化が終わったらPUBLISH_MAGIC
+  uint32_t version;
+  pid_t pid; // 公開しているプロセス(同じ名前の領域が残っていたときに、まだ使われているかを調べる)
+  _Atomic uint64_t seq;
+  _Atomic int done; // シミュレーションが終了したら1
+  double t;
+  size_t numobj;
+  Object objs[MAX_OBJECTS];
+} PublishedState;
+
+// 軌道の記録方式
+enum { TRAJECTORY_RAW, TRAJECTORY_COMPRESSED };
+
+// 軌道ファイルの形式(全て実行した計算機のバイト順)
+//   TrajectoryHeader
+//   フレームがnumframes個(時刻はdtの等間隔)
+//     RAW: TrajectoryFrame + Object[numobj]
+//     COMPRESSED: バイト数(uint16_t) + ビット列(上位ビットから詰める)
+//       キーフレーム: 1, 物体数(16), 時刻(64), 物体ごとに質量(64)と量子化したy, x, vy, vx(各64)
+//       それ以外: 0, 物体ごと・成分ごとに予測からの残差をジグザグ変換してライス符号にしたもの
+//   各フレームのファイル先頭からの位置(uint64_t)がnumframes個
+// バージョン1のファイルはcodec以降のフィールドがなく、RAWとして読む
+typedef struct trajectory_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t numframes;
+  uint64_t index_offset; // フレームの位置の表の位置(0なら表がない)
+  double dt; // フレームの間隔[秒]
+  double scale; // 記録したときの縮尺
+  double moon; // 記録したときのmoonモード
+  uint32_t codec; // TRAJECTORY_RAW か TRAJECTORY_COMPRESSED
+  uint32_t keyframe_interval; // キーフレームの間隔の最大
+  double pos_error; // 位置の誤差の上限[m] (量子化の幅はこの2倍)
+  double vel_error; // 速度の誤差の上限[m/s]
+} TrajectoryHeader;
+
+typedef struct trajectory_frame
+{
+  double t;
+  uint64_t numobj;
+  Object objs[];
+} TrajectoryFrame;
+
+// 圧縮した軌道の予測と符号化の状態(書く側と読む側で同じように更新する)
+typedef struct trajectory_codec
+{
+  size_t numobj;
+  size_t since_key; // 直前のキーフレームから何フレーム目か
+  double t_key; // 直前のキーフレームの時刻
+  double m[MAX_OBJECTS];
+  int64_t history[3][MAX_OBJECTS][4]; // 直前3フレームの量子化したy, x, vy, vx (history[0]が1つ前)
+  uint64_t sum[MAX_OBJECTS][4]; // ライス符号のパラメータを決める残差の合計と個数
+  uint64_t count[MAX_OBJECTS][4];
+} TrajectoryCodec;
+
+// 軌道を記録する
+typedef struct trajectory_writer
+{
+  FILE *fp;
+  TrajectoryHeader header;
+  TrajectoryCodec codec;
+  uint64_t raw_bytes; // 圧縮しなかった場合の大きさ
+  uint64_t offset; // 次のフレームを書く位置
+  uint64_t *index; // 各フレームの位置
+  size_t numframes, capacity;
+} TrajectoryWriter;
+
+// mmapで読み込んだ軌道
+typedef struct trajectory
+{
+  void *map;
+  size_t size;
+  TrajectoryHeader header; // ヘッダの写し(バージョン1のファイルでは足りない分を補ったもの)
+  const uint64_t *index;
+  uint64_t *owned_index; // ファイルに表がなくて作った場合はここに置く
+  size_t numframes;
+  int codec;
+  size_t data_offset; // 最初のフレームの位置
+  double t_begin; // 最初のフレームの時刻
+  TrajectoryCodec state; // 圧縮した軌道を復元するときの状態
+  size_t decoded; // frameに復元してあるフレームの番号(なければSIZE_MAX)
+  TrajectoryFrame *frame; // 復元したフレーム(Object[MAX_OBJECTS]分の領域がある)
+} Trajectory;
+
+// 描画スレッドに渡す引数
+typedef struct render_args
+{
+  FrameRing *ring;
+  Condition cond;
+  int line; // 前回表示した行数
+  size_t rendered; // 表示したフレーム数
+  size_t skipped; // 表示せずに読み飛ばしたフレーム数
+  Diagnostics initial; // 保存量の初期値
+} RenderArgs;
+
+// 画像に書き出すときの設定
+typedef struct image_options
+{
+  const char *prefix; // 出力するファイル名の先頭(<prefix>000000.ppm, ...)
+  int width, height; // 画像の大きさ[ピクセル]
+  int trail; // 軌跡として残すサンプル数(0なら描かない)
+  int every; // 何ステップ(再生なら何フレーム)ごとに1枚描くか
+  int workers; // 描画するスレッドの数
+} ImageOptions;
+
+// 描画するスレッドに渡す1枚分。座標はすでにピクセルに変換してある
+typedef struct image_job
+{
+  size_t number; // 画像の通し番号
+  size_t numobj;
+  int ntrail; // 軌跡のサンプル数(今の位置を含む)
+  double radius[MAX_OBJECTS]; // 質量から決めた点の半径[ピクセル]
+  double *py, *px; // [k * MAX_OBJECTS + i] がkサンプル前のi番目の物体の位置
+} ImageJob;
+
+// 画像を並列に描いて書き出す
+// ジョブは空きと描画待ちの2つのリストの間を行き来するので、描画中のジョブが上書きされることはない
+typedef struct image_renderer
+{
+  ImageOptions options;
+  Condition cond;
+  pthread_mutex_t lock;
+  pthread_cond_t ready_cond, free_cond;
+  int capacity;
+  ImageJob *jobs;
+  int *ready; // 描画待ちのジョブの番号(先に入れたものから描く)
+  int nready, ready_head;
+  int *free_list; // 空いているジョブの番号
+  int nfree;
+  int done; // これ以上ジョブを入れないなら1
+  pthread_t *threads;
+  double *trail_y, *trail_x; // 直近のサンプルの位置(リング)
+  int trail_head, trail_count;
+  size_t submitted; // 入れた画像の数
+  double waited; // 空きのジョブを待った時間[秒] (描画が追いつかない分)
+} ImageRenderer;
+
+int my_plot_objects(const Object objs[], const size_t numobj, const double t, const View view, const Condition cond);
+// potentialがNULLでなければ、ポテンシャルエネルギーを求めて足し込む
+void my_update_velocities(Object objs[], const size_t numobj, const Condition cond, double *potential);
 void my_update_positions(Object objs[], const size_t numobj, const Condition cond);
 
+// 位置をh[秒]だけ進める
+void drift(Object objs[], const size_t numobj, const double h);
+
+// 加速度を求める。potentialがNULLでなければポテンシャルエネルギーを足し込む
+void compute_accelerations(const Object objs[], const size_t numobj, double ay[], double ax[], const Condition cond, double *potential);
+
+// 名前から積分法を求める。なければ-1を返す
+int integrator_by_name(const char *name);
+
+// 積分法の状態を初期化する
+Integrator create_integrator(const int method, const double tolerance);
+
+// 指定した積分法でcond.dtだけ進める(ias15は内部で刻み幅を選んで何ステップか進める)
+void integrate_step(Object objs[], const size_t numobj, Integrator *integ, const Condition cond, double *potential);
+
+// ias15 の1ステップ。実際に進めた刻み幅を返し、integ->dt を次に試す刻み幅にする
+double radau_step(Object objs[], const size_t numobj, Integrator *integ, const double dt, const Condition cond);
+
+// condのdtとmoonだけを変えた条件
+Condition condition_with_dt(const Condition cond, const double dt, const double moon);
+
+// 全エネルギー
+double total_energy(const Object objs[], const size_t numobj, const Condition cond);
+
+// 場面scを指定した積分法で1周期をdivisionsステップに分けて計算する
+// ias15 はdivisionsを無視して許容誤差toleranceで刻み幅を選ぶ
+BenchmarkResult run_scenario(const Scenario *sc, const char *filename, const int integrator, const int divisions, const double tolerance, const Condition base);
+
+// 全ての場面、積分法、時間刻み幅の組み合わせを計算して比べる
+void run_benchmark(const char *filename, const Condition base);
+
+// 運動エネルギー、運動量、角運動量を求める(ポテンシャルエネルギーはそのまま)
+void measure_conserved(const Object objs[], const size_t numobj, Diagnostics *diag);
+
+// 保存量の初期値からのずれを表示する
+void print_conservation(const Diagnostics *initial, const Diagnostics *now);
+
 // 座標が画面内にあるかどうか判定する
 int in_screen(double y, double x, const Condition cond);
 
@@ -35,4 +329,90 @@ int is_monotonic(double a, double b, double c);
 void load_objects(Object objs[], size_t *numobj, char filename[], const Condition cond);
 
 // 二つのオブジェクトの距離を求める
-double distance(Object o1, Object o2, const Condition cond);
\ No newline at end of file
+double distance(Object o1, Object o2, const Condition cond);
+
+// 3枚のフレームを書き込み側・受け渡し・読み出し側に割り当てる
+void ring_init(FrameRing *ring);
+
+// フレームを書き込んで描画スレッドに渡す(前に渡したフレームがまだ読まれていなければ置き換える)
+void ring_push(FrameRing *ring, const Object objs[], const size_t numobj, const double t, const View view, const Diagnostics diag);
+
+// 前回から新しく渡されたフレームがあれば受け取り、なければNULLを返す
+// 受け取ったフレームは次にring_latestを呼ぶまで書き換えられない。skippedには置き換えられて表示しなかったフレーム数を足す
+const Frame *ring_latest(FrameRing *ring, size_t *skipped);
+
+// 一定間隔で最新のフレームを表示するスレッド
+void *render_thread(void *arg);
+
+// tsをns[ナノ秒]進める
+void timespec_add_ns(struct timespec *ts, const long ns);
+
+// a - b [秒]を求める
+double timespec_diff(const struct timespec *a, const struct timespec *b);
+
+// 端末をエコーなし・ノンブロッキングの入力モードにする(終了時に元に戻す)
+void enable_raw_input(void);
+void restore_input(void);
+
+// 溜まっているキー入力を全て処理して表示範囲を変更する。qが押されたら0を返す
+// playbackがNULLでなければ再生用のキーも処理する
+int poll_keys(View *view, Playback *playback, const size_t numobj, const Condition cond);
+
+// 状態を公開する共有メモリを作る(他のプロセスが公開中なら終了する。異常終了で残った領域は作り直す)
+PublishedState *create_published_state(const char *name);
+
+// 状態を書き込む(読む側を待たない)
+void publish_state(PublishedState *state, const Object objs[], const size_t numobj, const double t);
+
+// 共有メモリを解放して名前を消す
+void destroy_published_state(PublishedState *state, const char *name);
+
+// 軌道を記録するファイルを開く。pos_errorが0より大きければ、位置と速度をその誤差以内に量子化して圧縮する
+TrajectoryWriter *open_trajectory_writer(const char *filename, const Condition cond, const double pos_error, const double vel_error);
+
+// 1フレーム分を書き込む
+void write_trajectory_frame(TrajectoryWriter *w, const Object objs[], const size_t numobj, const double t);
+
+// フレームの位置の表を書いてファイルを閉じる
+void close_trajectory_writer(TrajectoryWriter *w);
+
+// 軌道のファイルをmmapで開く
+void open_trajectory(Trajectory *traj, const char *filename);
+
+// k番目のフレーム(圧縮してあれば直前のキーフレームか、前に復元したフレームから順に復元する)
+const TrajectoryFrame *trajectory_frame(Trajectory *traj, const size_t k);
+
+// 1フレーム分を圧縮してbufに書き、バイト数を返す
+size_t encode_trajectory_frame(TrajectoryCodec *codec, const TrajectoryHeader *header, const Object objs[], const size_t numobj, const double t, uint8_t *buf);
+
+// 1フレーム分を復元してframeに書く。前のフレームはframeに入っているものとする
+void decode_trajectory_frame(TrajectoryCodec *codec, const TrajectoryHeader *header, const uint8_t *data, const size_t len, TrajectoryFrame *frame);
+
+// 時刻tに最も近いフレームの番号を求める
+size_t trajectory_seek(const Trajectory *traj, const double t);
+
+void close_trajectory(Trajectory *traj);
+
+// 軌道を端末に再生する
+void replay_trajectory(Trajectory *traj, double speed, const Condition cond);
+
+// "1920x1080"の形の大きさを読む。読めなければ0を返す
+int parse_image_size(const char *text, int *width, int *height);
+
+// 描画するスレッドを起動する
+void start_image_renderer(ImageRenderer *r, const ImageOptions options, const Condition cond);
+
+// 今の状態を1枚分として描画待ちに入れる(空きがなければ描画が終わるのを待つ)
+void submit_image(ImageRenderer *r, const Object objs[], const size_t numobj);
+
+// 残りを全て描き終えるのを待って、スレッドを終了させる
+void finish_image_renderer(ImageRenderer *r);
+
+// 1枚分を描いてPPMファイルに書き出す。rgbはwidth * height * 3バイト
+void rasterize_image(const ImageJob *job, unsigned char rgb[], const ImageOptions *options);
+
+// 画像に書き出しながらstop_timeまで進める
+void render_images(Object objs[], const size_t numobj, Integrator *integ, const double stop_time, const ImageOptions options, const Condition cond);
+
+// 記録した軌道を画像に書き出す
+void render_trajectory_images(Trajectory *traj, const ImageOptions options, const Condition cond);
\ No newline at end of file
@@ -0,0 +1,97 @@
+/*
+  my_bouncing4 が -P で公開している状態を読み出して表示するビューア
+
+  シミュレーションの実行中にいつでも接続・切断できる。
+  共有メモリは読み取り専用で開くので、シミュレーション側には何の影響もない。
+
+  コンパイル:
+    gcc -Wall -O2 -o my_viewer4 my_viewer4.c -lm
+
+  実行例:
+    (別の端末で) ./a.out -P /my_bouncing4 data4_solar_system.dat 4329 3 2
+    ./my_viewer4 /my_bouncing4
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "my_bouncing4.h"
+
+// 一貫した状態を読み出す。書き込みが続いて読めなかったら0を返す
+static int read_published_state(const PublishedState *state, double *t, size_t *numobj, Object objs[]) {
+
+  for (int retry = 0; retry < 1000; retry++) {
+    uint64_t before = atomic_load_explicit(&state->seq, memory_order_acquire);
+    if (before % 2 == 1) {
+      sched_yield();
+      continue;
+    }
+
+    *t = state->t;
+    *numobj = state->numobj;
+    if (*numobj > MAX_OBJECTS) continue;
+    memcpy(objs, state->objs, sizeof(Object) * *numobj);
+
+    // 読んでいる間に書き込みがなければ一貫している
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&state->seq, memory_order_relaxed);
+    if (before == after) return 1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <name> [<interval[ms]>]\n", argv[0]);
+    return 1;
+  }
+
+  const int interval = (argc >= 3 ? atoi(argv[2]) : 500);
+  const double au = 149597870700;
+
+  int fd = shm_open(argv[1], O_RDONLY, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't open shared memory '%s'\n", argv[1]);
+    return 1;
+  }
+
+  const PublishedState *state = mmap(NULL, sizeof(PublishedState), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED) {
+    fprintf(stderr, "Couldn't map shared memory '%s'\n", argv[1]);
+    return 1;
+  }
+
+  if (atomic_load_explicit(&state->magic, memory_order_acquire) != PUBLISH_MAGIC || state->version != PUBLISH_VERSION) {
+    fprintf(stderr, "'%s' is not a my_bouncing4 state\n", argv[1]);
+    return 1;
+  }
+
+  static Object objs[MAX_OBJECTS];
+  double t;
+  size_t numobj;
+
+  while (!atomic_load_explicit(&state->done, memory_order_acquire)) {
+
+    if (read_published_state(state, &t, &numobj, objs)) {
+      printf("t = %.1lf days, numobj = %zu\n", t / 60 / 60 / 24, numobj);
+      for (int i=0; i<numobj; i++) {
+        printf("  %d: .y = %6.2lf .x = %6.2lf [au]\n", i, objs[i].y / au, objs[i].x / au);
+      }
+    }
+
+    usleep(interval * 1000);
+  }
+
+  printf("simulation finished\n");
+  munmap((void *)state, sizeof(PublishedState));
+
+  return EXIT_SUCCESS;
+}